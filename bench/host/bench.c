@@ -0,0 +1,347 @@
+#include "host.h"
+#include "pmm.h"
+#include "paging.h"
+#include "kheap.h"
+#include "vmm.h"
+#include "kprintf.h"
+
+// Randomized stress + microbenchmarks for the PMM, kmalloc, VMM regions and vmalloc (make bench-host)
+// Every test runs a fixed number of random alloc/free operations against a bounded live set, checks the memory it gets back
+// is really the caller's, and reports throughput, the slowest single operation, and how much memory the live set cost
+
+typedef struct {
+    uint32_t ops;
+    uint32_t start_us;
+    uint32_t worst_alloc; // cycles
+    uint32_t worst_free;
+} bench_t;
+
+static void bench_start(bench_t* b) {
+    b->ops = 0;
+    b->worst_alloc = 0;
+    b->worst_free = 0;
+    b->start_us = (uint32_t)host_time_us();
+}
+
+static void bench_report(bench_t* b, const char* name) {
+    uint32_t us = (uint32_t)host_time_us() - b->start_us;
+    if (us == 0) us = 1;
+    REPORT("%s: %u ops in %u ms, %u Kops/s, worst alloc %u cycles, worst free %u cycles\n",
+        name, b->ops, us / 1000, b->ops * 1000 / us, b->worst_alloc, b->worst_free);
+}
+
+static void fail(const char* what, uint32_t addr) {
+    REPORT("FAILED: %s (0x%x)\n", what, addr);
+    host_exit(1);
+}
+
+// PMM: single frames and small buddy blocks
+
+#define PMM_LIVE 4096
+#define PMM_OPS 400000
+
+static uint32_t pmm_live[PMM_LIVE];
+static uint8_t pmm_order[PMM_LIVE];
+
+static void bench_pmm(void) {
+    bench_t b;
+    bench_start(&b);
+    uint32_t free_before = pmm_get_free_memory_kb();
+
+    for (uint32_t i = 0; i < PMM_OPS; i++) {
+        uint32_t slot = host_rand() % PMM_LIVE;
+        if (pmm_live[slot]) {
+            uint32_t t = host_cycles();
+            pmm_free_frames((void*)pmm_live[slot], pmm_order[slot]);
+            t = host_cycles() - t;
+            if (t > b.worst_free) b.worst_free = t;
+            pmm_live[slot] = 0;
+        } else {
+            uint32_t order = (host_rand() & 3) == 0 ? host_rand() % 4 : 0; // mostly single frames
+            uint32_t t = host_cycles();
+            uint32_t frame = (uint32_t)pmm_alloc_frames(order);
+            t = host_cycles() - t;
+            if (t > b.worst_alloc) b.worst_alloc = t;
+            if (!frame) fail("pmm_alloc_frames returned NULL", order);
+            if (frame & ((PAGE_SIZE << order) - 1)) fail("buddy block not aligned to its size", frame);
+            pmm_live[slot] = frame;
+            pmm_order[slot] = order;
+        }
+        b.ops++;
+    }
+    bench_report(&b, "pmm frames");
+
+    for (uint32_t i = 0; i < PMM_LIVE; i++) {
+        if (pmm_live[i]) pmm_free_frames((void*)pmm_live[i], pmm_order[i]);
+        pmm_live[i] = 0;
+    }
+    if (pmm_get_free_memory_kb() != free_before) fail("PMM didn't get every frame back (KB)", free_before - pmm_get_free_memory_kb());
+}
+
+// kmalloc: mostly small objects, some medium, a few big and a few aligned, each stamped with its slot number at both ends
+
+#define HEAP_LIVE 4096
+#define HEAP_OPS 400000
+
+static uint8_t* heap_live[HEAP_LIVE];
+static uint32_t heap_size[HEAP_LIVE];
+
+static uint32_t random_size(void) {
+    uint32_t r = host_rand() % 100;
+    if (r < 70) return 8 + host_rand() % 249;
+    if (r < 90) return 257 + host_rand() % 1792;
+    return 2049 + host_rand() % 14336;
+}
+
+static void bench_kmalloc(void) {
+    bench_t b;
+    bench_start(&b);
+    uint32_t free_before = pmm_get_free_memory_kb();
+    uint32_t held_before = kheap_get_used() + kheap_get_free(); // the heap's initial pages were taken from the PMM at boot
+    uint32_t live_bytes = 0;
+    uint32_t peak_live = 0;
+    uint32_t peak_taken = 0;
+
+    for (uint32_t i = 0; i < HEAP_OPS; i++) {
+        uint32_t slot = host_rand() % HEAP_LIVE;
+        uint8_t* p = heap_live[slot];
+        if (p) {
+            if (p[0] != (uint8_t)slot || p[heap_size[slot] - 1] != (uint8_t)slot) fail("kmalloc block was overwritten", (uint32_t)p);
+            uint32_t t = host_cycles();
+            kfree(p);
+            t = host_cycles() - t;
+            if (t > b.worst_free) b.worst_free = t;
+            live_bytes -= heap_size[slot];
+            heap_live[slot] = NULL;
+        } else {
+            uint32_t size = random_size();
+            uint32_t align = (host_rand() % 20) == 0 ? 16u << (host_rand() % 9) : 0; // 5% aligned, 16B..4KB
+            uint32_t t = host_cycles();
+            p = align ? kmalloc_aligned(size, align) : kmalloc(size);
+            t = host_cycles() - t;
+            if (t > b.worst_alloc) b.worst_alloc = t;
+            if (!p) fail("kmalloc returned NULL", size);
+            if (align && ((uint32_t)p & (align - 1))) fail("kmalloc_aligned result misaligned", (uint32_t)p);
+            p[0] = (uint8_t)slot;
+            p[size - 1] = (uint8_t)slot;
+            heap_live[slot] = p;
+            heap_size[slot] = size;
+            live_bytes += size;
+            if (live_bytes > peak_live) {
+                peak_live = live_bytes;
+                peak_taken = held_before + (free_before - pmm_get_free_memory_kb()) * 1024;
+            }
+        }
+        b.ops++;
+    }
+    bench_report(&b, "kmalloc");
+
+    // fragmentation: what the live set asked for vs. what the heap and slabs took from the PMM to hold it, at the peak
+    REPORT("kmalloc: peak live %u KB held in %u KB of frames, %u percent overhead\n",
+        peak_live / 1024, peak_taken / 1024, peak_live ? (peak_taken - peak_live) * 100 / peak_live : 0);
+
+    for (uint32_t i = 0; i < HEAP_LIVE; i++) {
+        kfree(heap_live[i]);
+        heap_live[i] = NULL;
+    }
+    kheap_maintain(); // the idle thread's part, TLSF kfree only trims a batch at a time
+    REPORT("kmalloc: after freeing everything %u KB still in use, %u KB trimmed back to the PMM\n",
+        kheap_get_used() / 1024, kheap_get_reclaimed() / 1024);
+    if (kheap_get_used() != 0) fail("heap still reports bytes in use", kheap_get_used());
+}
+
+// VMM: regions of 1-16 pages mapped and unmapped at random in one process address space, then address space churn
+
+#define REGION_LIVE 128
+#define REGION_OPS 50000
+#define SPACE_OPS 2000
+#define LOOKUP_REGIONS 512
+#define LOOKUP_OPS 200000
+#define USER_BASE 0x00400000
+
+static uint32_t region_live[REGION_LIVE];
+
+static void bench_vmm(void) {
+    uint32_t free_before = pmm_get_free_memory_kb();
+    vmm_address_space_t* space = vmm_create_address_space();
+    if (!space) fail("vmm_create_address_space", 0);
+
+    bench_t b;
+    bench_start(&b);
+    for (uint32_t i = 0; i < REGION_OPS; i++) {
+        uint32_t slot = host_rand() % REGION_LIVE;
+        if (region_live[slot]) {
+            uint32_t t = host_cycles();
+            if (vmm_unmap_region(space, region_live[slot]) < 0) fail("vmm_unmap_region", region_live[slot]);
+            t = host_cycles() - t;
+            if (t > b.worst_free) b.worst_free = t;
+            region_live[slot] = 0;
+        } else {
+            uint32_t size = (1 + host_rand() % 16) * PAGE_SIZE;
+            uint32_t t = host_cycles();
+            uint32_t vaddr = vmm_find_free_region(space, size, USER_BASE);
+            if (!vaddr || vaddr + size > KERNEL_VIRTUAL_BASE) fail("vmm_find_free_region", size);
+            if (vmm_map_region(space, vaddr, size, VMM_READ | VMM_WRITE | VMM_USER, REGION_USER_DATA) < 0) fail("vmm_map_region", vaddr);
+            t = host_cycles() - t;
+            if (t > b.worst_alloc) b.worst_alloc = t;
+            region_live[slot] = vaddr;
+        }
+        b.ops++;
+    }
+    bench_report(&b, "vmm regions (find + map / unmap)");
+
+    for (uint32_t i = 0; i < REGION_LIVE; i++) {
+        if (region_live[i]) vmm_unmap_region(space, region_live[i]);
+        region_live[i] = 0;
+    }
+    vmm_destroy_address_space(space);
+
+    bench_start(&b);
+    for (uint32_t i = 0; i < SPACE_OPS; i++) {
+        uint32_t t = host_cycles();
+        space = vmm_create_address_space();
+        if (!space || vmm_map_region(space, USER_BASE, 4 * PAGE_SIZE, VMM_READ | VMM_WRITE | VMM_USER, REGION_USER_CODE) < 0) {
+            fail("address space setup", i);
+        }
+        t = host_cycles() - t;
+        if (t > b.worst_alloc) b.worst_alloc = t;
+
+        t = host_cycles();
+        vmm_destroy_address_space(space);
+        t = host_cycles() - t;
+        if (t > b.worst_free) b.worst_free = t;
+        b.ops += 2;
+    }
+    bench_report(&b, "vmm address spaces (create + map / destroy)");
+
+    // copy-on-write clones of a template with 1MB of data in it, only page tables and refcounts should be paid for
+    vmm_address_space_t* template = vmm_create_address_space();
+    if (!template || vmm_map_region(template, USER_BASE, 256 * PAGE_SIZE, VMM_READ | VMM_WRITE | VMM_USER, REGION_USER_DATA) < 0) {
+        fail("clone template setup", 0);
+    }
+    bench_start(&b);
+    for (uint32_t i = 0; i < SPACE_OPS; i++) {
+        uint32_t t = host_cycles();
+        space = vmm_clone_address_space(template);
+        if (!space) fail("vmm_clone_address_space", i);
+        t = host_cycles() - t;
+        if (t > b.worst_alloc) b.worst_alloc = t;
+
+        t = host_cycles();
+        vmm_destroy_address_space(space);
+        t = host_cycles() - t;
+        if (t > b.worst_free) b.worst_free = t;
+        b.ops += 2;
+    }
+    bench_report(&b, "vmm clone of 1MB template (clone / destroy)");
+    vmm_destroy_address_space(template);
+
+    // region lookup (what every page fault does) in a space with LOOKUP_REGIONS single-page regions, half of the lookups miss
+    space = vmm_create_address_space();
+    if (!space) fail("vmm_create_address_space", 0);
+    for (uint32_t i = 0; i < LOOKUP_REGIONS; i++) {
+        if (vmm_map_region(space, USER_BASE + i * 2 * PAGE_SIZE, PAGE_SIZE, VMM_READ | VMM_WRITE | VMM_USER | VMM_LAZY, REGION_USER_DATA) < 0) {
+            fail("lookup setup", i);
+        }
+    }
+    uint32_t start = host_cycles();
+    uint32_t hits = 0;
+    for (uint32_t i = 0; i < LOOKUP_OPS; i++) {
+        uint32_t addr = USER_BASE + (host_rand() % (LOOKUP_REGIONS * 2)) * PAGE_SIZE;
+        if (vmm_find_region(space, addr)) hits++;
+    }
+    uint32_t per_lookup = (host_cycles() - start) / LOOKUP_OPS;
+    if (hits < LOOKUP_OPS / 3 || hits > LOOKUP_OPS * 2 / 3) fail("lookup hit rate is off", hits);
+    REPORT("vmm lookup, %u regions: %u cycles per vmm_find_region\n", space->region_count, per_lookup);
+
+    // free range search in the same space: the one-page holes between the regions are all too small for two pages,
+    // so the answer is always past the last of them
+    start = host_cycles();
+    for (uint32_t i = 0; i < LOOKUP_OPS / 100; i++) {
+        uint32_t vaddr = vmm_find_free_region(space, 2 * PAGE_SIZE, USER_BASE);
+        if (vaddr != USER_BASE + LOOKUP_REGIONS * 2 * PAGE_SIZE - PAGE_SIZE) fail("vmm_find_free_region picked the wrong gap", vaddr);
+    }
+    REPORT("vmm free range search, %u regions: %u cycles per vmm_find_free_region\n", space->region_count, (host_cycles() - start) / (LOOKUP_OPS / 100));
+
+    // and top down from the end of the last region, where the first hole that fits is the one below all of them
+    start = host_cycles();
+    for (uint32_t i = 0; i < LOOKUP_OPS / 100; i++) {
+        uint32_t vaddr = vmm_find_free_region_top_down(space, 2 * PAGE_SIZE, USER_BASE + LOOKUP_REGIONS * 2 * PAGE_SIZE - PAGE_SIZE);
+        if (vaddr != USER_BASE - 2 * PAGE_SIZE) fail("vmm_find_free_region_top_down picked the wrong gap", vaddr);
+    }
+    REPORT("vmm free range search, %u regions: %u cycles per vmm_find_free_region_top_down\n", space->region_count, (host_cycles() - start) / (LOOKUP_OPS / 100));
+    vmm_destroy_address_space(space);
+
+    // the object caches keep a slab or so around, anything beyond that is a leak
+    uint32_t free_after = pmm_get_free_memory_kb();
+    uint32_t kept = free_after < free_before ? free_before - free_after : 0;
+    REPORT("vmm: %u KB not returned to the PMM afterwards (cached slabs)\n", kept);
+    if (kept > 256) fail("VMM is leaking memory (KB)", kept);
+}
+
+// vmalloc: buffers of 1-64 pages, every page touched
+// the paging stub backs each page with an mmap/munmap of its own, so here the host's syscalls dominate and the numbers are only
+// useful relative to each other
+
+#define VMALLOC_LIVE 64
+#define VMALLOC_OPS 5000
+
+static uint8_t* vmalloc_live[VMALLOC_LIVE];
+static uint32_t vmalloc_size[VMALLOC_LIVE];
+
+static void bench_vmalloc(void) {
+    bench_t b;
+    bench_start(&b);
+    for (uint32_t i = 0; i < VMALLOC_OPS; i++) {
+        uint32_t slot = host_rand() % VMALLOC_LIVE;
+        uint8_t* p = vmalloc_live[slot];
+        if (p) {
+            for (uint32_t off = 0; off < vmalloc_size[slot]; off += PAGE_SIZE) {
+                if (p[off] != (uint8_t)slot) fail("vmalloc buffer was overwritten", (uint32_t)p + off);
+            }
+            uint32_t t = host_cycles();
+            vfree(p);
+            t = host_cycles() - t;
+            if (t > b.worst_free) b.worst_free = t;
+            vmalloc_live[slot] = NULL;
+        } else {
+            uint32_t size = (1 + host_rand() % 64) * PAGE_SIZE;
+            uint32_t t = host_cycles();
+            p = vmalloc(size);
+            t = host_cycles() - t;
+            if (t > b.worst_alloc) b.worst_alloc = t;
+            if (!p) fail("vmalloc returned NULL", size);
+            for (uint32_t off = 0; off < size; off += PAGE_SIZE) {
+                if (p[off]) fail("vmalloc memory not zeroed", (uint32_t)p + off);
+                p[off] = (uint8_t)slot;
+            }
+            vmalloc_live[slot] = p;
+            vmalloc_size[slot] = size;
+        }
+        b.ops++;
+    }
+    bench_report(&b, "vmalloc (incl. host mmap per page)");
+
+    for (uint32_t i = 0; i < VMALLOC_LIVE; i++) {
+        vfree(vmalloc_live[i]);
+        vmalloc_live[i] = NULL;
+    }
+}
+
+int bench_main(void) {
+    host_boot();
+
+#ifdef KHEAP_TLSF
+    REPORT("bench-host: %u MB of fake RAM, kmalloc backend TLSF\n", HOST_RAM_SIZE / (1024 * 1024));
+#else
+    REPORT("bench-host: %u MB of fake RAM, kmalloc backend first fit\n", HOST_RAM_SIZE / (1024 * 1024));
+#endif
+
+    bench_pmm();
+    bench_kmalloc();
+    bench_vmm();
+    bench_vmalloc();
+
+    REPORT("bench-host: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include "host.h"
+#include "multiboot.h"
+#include "pmm.h"
+#include "kheap.h"
+#include "vmm.h"
+#include "terminal.h"
+
+void paging_stub_init(void);
+int bench_main(void);
+
+// Linux i386 syscall numbers
+#define SYS_EXIT_GROUP 252
+#define SYS_WRITE 4
+#define SYS_MMAP2 192
+#define SYS_MUNMAP 91
+#define SYS_FTRUNCATE 93
+#define SYS_CLOCK_GETTIME 265
+#define SYS_MEMFD_CREATE 356
+
+#define PROT_RW 3
+#define MAP_SHARED_FIXED 0x11
+#define CLOCK_MONOTONIC 1
+
+// the sixth argument goes in EBP, which GCC won't hand out as an operand. it's read from a static so the operand
+// can't end up relative to a stack/frame pointer that moved with the push
+static long syscall_arg6;
+
+static long host_syscall(long n, long a, long b, long c, long d, long e, long f) {
+    long ret;
+    syscall_arg6 = f;
+    __asm__ volatile("push %%ebp\n\tmov %7, %%ebp\n\tint $0x80\n\tpop %%ebp"
+        : "=a"(ret)
+        : "a"(n), "b"(a), "c"(b), "d"(c), "S"(d), "D"(e), "m"(syscall_arg6)
+        : "memory");
+    return ret;
+}
+
+void host_exit(int code) {
+    host_syscall(SYS_EXIT_GROUP, code, 0, 0, 0, 0, 0);
+    for (;;) {}
+}
+
+__asm__(
+    ".global _start\n"
+    "_start:\n"
+    "    xor %ebp, %ebp\n"
+    "    and $-16, %esp\n"
+    "    call host_main\n");
+
+void host_main(void) {
+    host_exit(bench_main());
+}
+
+// console
+
+int host_echo = 0;
+
+void terminal_putchar(char c) {
+    if (host_echo) host_syscall(SYS_WRITE, 1, (long)&c, 1, 0, 0, 0);
+}
+
+void terminal_writestring(const char* s) {
+    while (*s) terminal_putchar(*s++);
+}
+
+void serial_printf(const char* format, ...) {
+    (void)format;
+}
+
+void idt_register_handler(uint8_t interrupt, interrupt_handler_t handler) {
+    (void)interrupt;
+    (void)handler;
+}
+
+uint64_t host_time_us(void) {
+    struct { int32_t sec; int32_t nsec; } ts;
+    host_syscall(SYS_CLOCK_GETTIME, CLOCK_MONOTONIC, (long)&ts, 0, 0, 0, 0);
+    return (uint64_t)ts.sec * 1000000u + (uint32_t)ts.nsec / 1000u;
+}
+
+static uint32_t rand_state = 0x2545F491;
+
+uint32_t host_rand(void) {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+// RAM
+
+static int ram_fd = -1;
+
+void* host_mmap_ram(uint32_t virtual_addr, uint32_t physical_addr) {
+    long ret = host_syscall(SYS_MMAP2, virtual_addr, PAGE_SIZE, PROT_RW, MAP_SHARED_FIXED, ram_fd, physical_addr / PAGE_SIZE);
+    return ret == (long)virtual_addr ? (void*)virtual_addr : NULL;
+}
+
+void host_munmap(uint32_t virtual_addr) {
+    host_syscall(SYS_MUNMAP, virtual_addr, PAGE_SIZE, 0, 0, 0, 0);
+}
+
+static multiboot_info_t boot_info;
+static multiboot_mmap_entry_t boot_mmap[2];
+
+void host_boot(void) {
+    ram_fd = host_syscall(SYS_MEMFD_CREATE, (long)"ram", 0, 0, 0, 0, 0);
+    if (ram_fd < 0 || host_syscall(SYS_FTRUNCATE, ram_fd, HOST_RAM_SIZE, 0, 0, 0, 0) < 0) {
+        REPORT("host: couldn't create the RAM memfd\n");
+        host_exit(1);
+    }
+    long ram = host_syscall(SYS_MMAP2, KERNEL_VIRTUAL_BASE, HOST_RAM_SIZE, PROT_RW, MAP_SHARED_FIXED, ram_fd, 0);
+    if (ram != (long)KERNEL_VIRTUAL_BASE) {
+        REPORT("host: couldn't map RAM at 0x%x\n", KERNEL_VIRTUAL_BASE);
+        host_exit(1);
+    }
+
+    // the usual PC layout: conventional memory, the hole for VGA/BIOS, then everything from 1MB up
+    boot_mmap[0].size = sizeof(multiboot_mmap_entry_t) - sizeof(uint32_t);
+    boot_mmap[0].base_addr = 0;
+    boot_mmap[0].length = 0x9FC00;
+    boot_mmap[0].type = MULTIBOOT_MEMORY_AVAILABLE;
+    boot_mmap[1].size = sizeof(multiboot_mmap_entry_t) - sizeof(uint32_t);
+    boot_mmap[1].base_addr = 0x100000;
+    boot_mmap[1].length = HOST_RAM_SIZE - 0x100000;
+    boot_mmap[1].type = MULTIBOOT_MEMORY_AVAILABLE;
+
+    boot_info.flags = MULTIBOOT_FLAG_MEM | MULTIBOOT_FLAG_MMAP;
+    boot_info.mem_lower = 639;
+    boot_info.mem_upper = (HOST_RAM_SIZE - 0x100000) / 1024;
+    boot_info.mmap_addr = (uint32_t)boot_mmap;
+    boot_info.mmap_length = sizeof(boot_mmap);
+
+    pmm_init(&boot_info);
+    paging_stub_init();
+    kheap_init();
+    vmm_init();
+}
@@ -0,0 +1,52 @@
+#ifndef HOST_H
+#define HOST_H
+
+/*
+* Host-side environment for the allocator benchmarks (make bench-host)
+* The allocators are compiled as-is for 32-bit Linux and run as an ordinary process. There's no 32-bit libc to lean on, so this is a
+* few raw syscalls plus stand-ins for the bits of the kernel the allocators call into:
+*
+* - "physical RAM" is a memfd mapped at KERNEL_VIRTUAL_BASE, so the direct map (PHYS_TO_VIRT) works exactly like in the kernel
+* - the PMM gets a made-up multiboot memory map describing that RAM
+* - paging is a stub (paging_stub.c) that keeps real page tables in that RAM and, for pages in the kernel heap/vmalloc window,
+*   maps the same memfd page at the virtual address too, so kmalloc'd memory can actually be used
+* - kprintf goes nowhere unless host_echo is set, the kernel's own chatter would drown out the numbers
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include "paging.h"
+#include "kprintf.h"
+
+#define HOST_RAM_SIZE (128u * 1024 * 1024)
+
+// address the linker pretends the kernel image ends at (passed as --defsym), the PMM puts its bookkeeping right after it
+#define HOST_KERNEL_END 0xC0200000
+
+// set up the RAM and the multiboot map, then pmm_init/paging/heap/VMM in the kernel's boot order
+void host_boot(void);
+
+// kprintf output only reaches stdout while this is set
+extern int host_echo;
+
+// REPORT(...) is kprintf that always prints
+#define REPORT(...) do { host_echo = 1; kprintf(__VA_ARGS__); host_echo = 0; } while (0)
+
+uint64_t host_time_us(void);
+
+static inline uint32_t host_cycles(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo;
+}
+
+// xorshift32, deterministic so runs are comparable
+uint32_t host_rand(void);
+
+void host_exit(int code) __attribute__((noreturn));
+
+// used by paging_stub.c
+void* host_mmap_ram(uint32_t virtual_addr, uint32_t physical_addr);
+void host_munmap(uint32_t virtual_addr);
+
+#endif
@@ -0,0 +1,145 @@
+#include "host.h"
+#include "paging.h"
+#include "pmm.h"
+#include "kheap.h"
+#include "string.h"
+
+// Stand-in for paging.c (which needs ring 0 for CR3/CR4/invlpg). The page tables are real, built out of PMM frames in the fake RAM
+// the same way paging.c does it, so directories, user-half tables and frame ownership behave the same. There's no TLB to manage.
+// Pages mapped in the kernel heap/vmalloc window are also mapped for real at that address (the same memfd page), so kmalloc'd memory
+// can be used; user-half mappings only exist in the tables, the benchmarks never touch them
+
+static page_dir_entry_t* kernel_dir = NULL; // virtual, in the direct map
+static page_dir_entry_t* current_dir = NULL;
+
+void paging_stub_init(void) {
+    uint32_t phys = (uint32_t)pmm_alloc_frame();
+    if (!phys) {
+        REPORT("paging stub: no frame for the kernel directory\n");
+        host_exit(1);
+    }
+    kernel_dir = (page_dir_entry_t*)PHYS_TO_VIRT(phys);
+    memset32(kernel_dir, 0x00000002, PAGE_ENTRIES);
+    current_dir = kernel_dir;
+}
+
+static int backed_window(uint32_t virtual_addr) {
+    return virtual_addr >= KHEAP_START && virtual_addr < KMAP_BASE;
+}
+
+static page_dir_entry_t* dir_for(uint32_t* dir_phys, uint32_t virtual_addr) {
+    if (!dir_phys || virtual_addr >= KERNEL_VIRTUAL_BASE) return kernel_dir;
+    return (page_dir_entry_t*)PHYS_TO_VIRT((uint32_t)dir_phys);
+}
+
+static page_table_entry_t* pte_for(page_dir_entry_t* dir, uint32_t virtual_addr, int create) {
+    uint32_t pd_index = virtual_addr >> 22;
+    if (!(dir[pd_index] & PAGE_PRESENT)) {
+        if (!create) return NULL;
+        uint32_t table = (uint32_t)pmm_alloc_zeroed_frame(PMM_ALLOC_KERNEL);
+        if (!table) return NULL;
+        dir[pd_index] = table | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+    }
+    page_table_entry_t* table = (page_table_entry_t*)PHYS_TO_VIRT(dir[pd_index] & 0xFFFFF000);
+    return &table[(virtual_addr >> 12) & 0x3FF];
+}
+
+int paging_map_range(uint32_t* dir, uint32_t virtual_addr, uint32_t size, uint32_t flags, paging_frame_source_t source, void* ctx) {
+    for (uint32_t addr = virtual_addr; addr < virtual_addr + size; addr += PAGE_SIZE) {
+        page_table_entry_t* pte = pte_for(dir_for(dir, addr), addr, 1);
+        if (!pte) return -1;
+        uint32_t frame = source(ctx);
+        if (!frame) return -1;
+        if (backed_window(addr) && !host_mmap_ram(addr, frame)) {
+            REPORT("paging stub: couldn't back 0x%x\n", addr);
+            host_exit(1);
+        }
+        *pte = (frame & 0xFFFFF000) | (flags & 0xFFF) | PAGE_PRESENT;
+    }
+    return 0;
+}
+
+uint32_t paging_unmap_range(uint32_t* dir, uint32_t virtual_addr, uint32_t size, paging_frame_sink_t sink, void* ctx) {
+    uint32_t count = 0;
+    for (uint32_t addr = virtual_addr; addr < virtual_addr + size; addr += PAGE_SIZE) {
+        page_table_entry_t* pte = pte_for(dir_for(dir, addr), addr, 0);
+        if (!pte || !(*pte & PAGE_PRESENT)) continue;
+        uint32_t frame = *pte & 0xFFFFF000;
+        *pte = 0;
+        if (backed_window(addr)) host_munmap(addr);
+        if (sink) sink(frame, ctx);
+        count++;
+    }
+    return count;
+}
+
+int paging_share_range(uint32_t* src, uint32_t* dst, uint32_t virtual_addr, uint32_t size, paging_frame_sink_t share, void* ctx) {
+    for (uint32_t addr = virtual_addr; addr < virtual_addr + size; addr += PAGE_SIZE) {
+        page_table_entry_t* from = pte_for(dir_for(src, addr), addr, 0);
+        if (!from || !(*from & PAGE_PRESENT)) continue;
+        page_table_entry_t* to = pte_for(dir_for(dst, addr), addr, 1);
+        if (!to) return -1;
+        *from &= ~PAGE_WRITE;
+        *to = *from;
+        if (share) share(*from & 0xFFFFF000, ctx);
+    }
+    return 0;
+}
+
+// only reachable from the page fault handler, which never runs here
+void paging_map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags) {
+    page_table_entry_t* pte = pte_for(virtual_addr >= KERNEL_VIRTUAL_BASE ? kernel_dir : current_dir, virtual_addr, 1);
+    if (pte) *pte = (physical_addr & 0xFFFFF000) | (flags & 0xFFF) | PAGE_PRESENT;
+}
+
+uint32_t paging_get_physical(uint32_t virtual_addr) {
+    if (virtual_addr >= KERNEL_VIRTUAL_BASE && virtual_addr < KERNEL_VIRTUAL_BASE + HOST_RAM_SIZE) {
+        return VIRT_TO_PHYS(virtual_addr);
+    }
+    page_table_entry_t* pte = pte_for(virtual_addr >= KERNEL_VIRTUAL_BASE ? kernel_dir : current_dir, virtual_addr, 0);
+    if (!pte || !(*pte & PAGE_PRESENT)) return 0;
+    return (*pte & 0xFFFFF000) | (virtual_addr & 0xFFF);
+}
+
+uint32_t paging_get_direct_map_end(void) {
+    return HOST_RAM_SIZE;
+}
+
+uint32_t* paging_get_directory(void) {
+    return (uint32_t*)VIRT_TO_PHYS((uint32_t)kernel_dir);
+}
+
+uint32_t* paging_get_loaded_directory(void) {
+    return (uint32_t*)VIRT_TO_PHYS((uint32_t)current_dir);
+}
+
+uint32_t* paging_create_directory(void) {
+    uint32_t phys = (uint32_t)pmm_alloc_frame();
+    if (!phys) return NULL;
+    uint32_t* dir = (uint32_t*)PHYS_TO_VIRT(phys);
+    memset32(dir, 0x00000002, 768);
+    memcpy(&dir[768], &kernel_dir[768], 256 * sizeof(uint32_t));
+    return (uint32_t*)phys;
+}
+
+void paging_destroy_directory(uint32_t* dir_phys) {
+    if (!dir_phys) return;
+    uint32_t* dir = (uint32_t*)PHYS_TO_VIRT((uint32_t)dir_phys);
+    for (int i = 0; i < 768; i++) {
+        if (dir[i] & PAGE_PRESENT) pmm_free_frame((void*)(dir[i] & 0xFFFFF000));
+    }
+    pmm_free_frame(dir_phys);
+}
+
+void paging_switch_directory(uint32_t* dir_phys) {
+    current_dir = (page_dir_entry_t*)PHYS_TO_VIRT((uint32_t)dir_phys);
+}
+
+// the host RAM is all direct-mapped, there's no high memory to window
+void* paging_kmap(uint32_t physical_addr) {
+    return (void*)PHYS_TO_VIRT(physical_addr);
+}
+
+void paging_kunmap(void* virtual_addr) {
+    (void)virtual_addr;
+}
@@ -5,7 +5,7 @@
 #   EBX = pointer to multiboot info struct (physical address)
 #
 # Our job:
-#   1. Set up a temporary page directory that maps the first 4MB at both
+#   1. Set up a temporary page directory that maps the first 16MB at both
 #      the identity address (0x00000000) and the higher-half (0xC0000000)
 #   2. Enable paging
 #   3. Jump to the higher-half virtual address
@@ -15,6 +15,10 @@
 # (we're executing at physical ~0x100000 when we flip paging on, so that
 # address range needs to stay valid). paging_init() later builds the real
 # page tables and the identity map disappears when the new CR3 is loaded.
+#
+# 16MB rather than 4MB because pmm_init runs before paging_init and carves
+# its bookkeeping (bitmap, buddy maps, per-frame descriptors) out of the RAM
+# right after the kernel, and on a big machine that doesn't fit in 4MB.
 
 .set ALIGN, 1<<0
 .set MEMINFO, 1<<1
@@ -44,9 +48,10 @@
 boot_page_directory:
 .skip 4096
 
-# Temporary boot page table (maps first 4MB)
+# Temporary boot page tables (4 tables × 4MB, maps first 16MB)
+.set BOOT_PAGE_TABLES, 4
 boot_page_table:
-.skip 4096
+.skip 4096 * BOOT_PAGE_TABLES
 
 .align 16
 stack_bottom:
@@ -63,8 +68,8 @@ _start:
     movl %eax, %esi     # magic number
     movl %ebx, %edi     # multiboot info pointer (physical)
 
-    # ---- Fill the boot page table: identity map first 4MB ----
-    # 1024 entries × 4KB per page = 4MB coverage
+    # ---- Fill the boot page tables: identity map first 16MB ----
+    # The tables are contiguous, so this is one run of 4096 entries × 4KB = 16MB
     # Each entry: physical_address | PRESENT | WRITABLE
     movl $(boot_page_table - KERNEL_VIRTUAL_BASE), %ebx
     movl $0, %ecx        # physical address counter
@@ -76,7 +81,7 @@ _start:
 
     addl $4096, %ecx     # next 4KB page
     addl $4, %ebx        # next table entry
-    cmpl $(1024 * 4096), %ecx   # done when we've mapped 4MB
+    cmpl $(BOOT_PAGE_TABLES * 1024 * 4096), %ecx   # done when we've mapped 16MB
     jl .fill_table
 
     # ---- Set up the boot page directory ----
@@ -90,16 +95,21 @@ _start:
     cmpl $1024, %ecx
     jl .clear_pd
 
-    # Install the page table in TWO page directory slots:
+    # Install each page table in TWO page directory slots:
+    #   PD[0..3]:     identity map — virtual 0x00000000 maps to physical 0x00000000
+    #   PD[768..771]: higher-half — virtual 0xC0000000 maps to physical 0x00000000
     movl $(boot_page_table - KERNEL_VIRTUAL_BASE), %eax
     orl $0x003, %eax     # Present + Read/Write
-
-    # PD[0]:   identity map — virtual 0x00000000 maps to physical 0x00000000
     movl $(boot_page_directory - KERNEL_VIRTUAL_BASE), %ebx
-    movl %eax, (%ebx)
+    movl $0, %ecx
 
-    # PD[768]: higher-half — virtual 0xC0000000 maps to physical 0x00000000
-    movl %eax, (KERNEL_PD_INDEX * 4)(%ebx)
+.install_tables:
+    movl %eax, (%ebx, %ecx, 4)
+    movl %eax, (KERNEL_PD_INDEX * 4)(%ebx, %ecx, 4)
+    addl $4096, %eax     # next table
+    incl %ecx
+    cmpl $BOOT_PAGE_TABLES, %ecx
+    jl .install_tables
 
     # ---- Enable paging ----
     # Load page directory physical address into CR3
@@ -369,6 +369,11 @@ isr_common:
     mov %ax, %fs
     mov %ax, %gs
 
+    # C code assumes the direction flag is clear. memmove sets it for
+    # backward copies, and we might have interrupted it right there.
+    # iret restores the interrupted EFLAGS, so this doesn't leak back.
+    cld
+
     # Call the C handler.
     # Push a pointer to the stack frame as the argument.
     # ESP currently points to all the stuff we pushed, which matches
@@ -72,4 +72,19 @@
  typedef void (*interrupt_handler_t)(struct interrupt_frame *frame);
  void idt_register_handler(uint8_t interrupt, interrupt_handler_t handler);
 
+ /* Disable interrupts and hand back the old EFLAGS, so a short critical section
+ * (allocator bookkeeping etc.) can't be preempted by the timer halfway through.
+ * irq_restore() puts IF back the way it was, so these nest fine and are safe to
+ * call from code that already runs with interrupts off (ISRs, schedule()).
+ */
+ static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ volatile ("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+ }
+
+ static inline void irq_restore(uint32_t flags) {
+    __asm__ volatile ("push %0; popf" : : "r"(flags) : "memory", "cc");
+ }
+
  #endif
\ No newline at end of file
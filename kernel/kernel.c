@@ -20,6 +20,7 @@
 #include "vmm.h"
 #include "process.h"
 #include "scheduler.h"
+#include "string.h"
 
 // Make good comments, and good commits
 
@@ -93,14 +94,8 @@ void terminal_putentryat(char c, uint8_t color, size_t x, size_t y) {
 // Scroll the entire screen up by one line
 // Copy every line up by one row, then clear the last row (fill with spaces)
 void terminal_scroll(void) {
-    // Move each row up by one: copy row 1 to row 0, row 2 to row 1, etc.
-    for (size_t y = 0; y < VGA_HEIGHT - 1; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t dst = y * VGA_WIDTH + x; // destination: current row
-            const size_t src = (y + 1) * VGA_WIDTH + x; // source: next row down
-            terminal_buffer[dst] = terminal_buffer[src];
-        }
-    }
+    // Move each row up by one: rows 1..24 become rows 0..23 in one go (the ranges overlap, hence memmove)
+    memmove(terminal_buffer, terminal_buffer + VGA_WIDTH, (VGA_HEIGHT - 1) * VGA_WIDTH * sizeof(uint16_t));
     // Clear last row
     for (size_t x = 0; x < VGA_WIDTH; x++) {
         const size_t index = (VGA_HEIGHT - 1) * VGA_WIDTH + x;
@@ -179,16 +174,28 @@ static void terminal_print_int(uint32_t num) {
     }
 }
 
+// the demo threads sleep between prints instead of busy-waiting, so the idle class (PID 0, the page zeroer) gets the CPU in between
 void thread_a(void) {
             while (1) {
                 kprintf("A");
-                for (volatile int i = 0; i < 500000; i++); // busy-wait delay
+                kthread_sleep(10); // 100ms at 100Hz
             }
         }
 void thread_b(void) {
     while (1) {
         kprintf("B");
-        for (volatile int i = 0; i < 500000; i++);
+        kthread_sleep(10);
+    }
+}
+
+// Idle-priority thread that keeps the PMM's pool of pre-zeroed frames topped up, and does the heap's trimming/reserve upkeep
+// it only runs when nothing else wants the CPU, once there's nothing left to do it just waits for the next interrupt
+static void page_zeroer(void) {
+    while (1) {
+        int heap_work = kheap_maintain();
+        if (!pmm_zero_pool_refill() && !heap_work) {
+            __asm__ volatile("hlt");
+        }
     }
 }
 
@@ -222,14 +229,25 @@ void kernel_main(uint32_t magic, multiboot_info_t* mbi) {
         process_init();
         kthread_create(thread_a, "thread_a");
         kthread_create(thread_b, "thread_b");
+        process_t* zeroer = kthread_create(page_zeroer, "page_zeroer");
+        if (zeroer) {
+            zeroer->priority = PROCESS_PRIORITY_IDLE;
+        }
         scheduler_init();
         kprintf("Heap used: %u KB, free: %u KB\n", kheap_get_used() / 1024, kheap_get_free() / 1024);
-        kprintf("Free memory: %u KB\n", pmm_get_free_memory() / 1024);
+        kprintf("Free memory: %u KB\n", pmm_get_free_memory_kb());
     }
 
     kprintf("Welcome to TupleOS!\n");
     shell_init();
 
+    // from here on PID 0 is nothing but the hlt loop below, so it joins the idle class
+    // and stops competing with real threads (this is what gives the page zeroer its turn)
+    process_t* kernel_proc = process_get(0);
+    if (kernel_proc) {
+        kernel_proc->priority = PROCESS_PRIORITY_IDLE;
+    }
+
     while (1) {
         __asm__ volatile("hlt");
     }
@@ -1,56 +1,285 @@
 #include "kheap.h"
 #include "pmm.h"
 #include "paging.h"
+#include "slab.h"
+#include "string.h"
 #include "kprintf.h"
+#include "idt.h"
 
-// Simple block header for tracking allocations
+// Boundary-tag blocks
+// Every block is [header][payload][footer] and blocks sit back to back from heap_start to heap_end. The footer repeats the size and
+// free flag so a block can find its physical neighbour on the left without walking the heap, and the one on the right is just past
+// its own footer. That makes merging on free constant time. Free blocks are also on an explicit doubly linked free list, so allocation
+// only looks at free blocks instead of every block in the heap.
 typedef struct block_header {
-    uint32_t size; // Size of block not including header
+    uint32_t size; // Size of the payload, not including header and footer
     uint32_t is_free; // 1 = free, 0 = allocated
-    struct block_header* next; // Next block in list
+    struct block_header* next_free; // free list links, only meaningful while the block is free
+    struct block_header* prev_free;
 } block_header_t;
 
+typedef struct {
+    uint32_t size; // same as the header's
+    uint32_t is_free;
+} block_footer_t;
+
 #define HEADER_SIZE sizeof(block_header_t)
+#define FOOTER_SIZE sizeof(block_footer_t)
+#define BLOCK_OVERHEAD (HEADER_SIZE + FOOTER_SIZE)
+
+// don't split off leftovers smaller than this, they'd just be clutter on the free list
+#define MIN_SPLIT_PAYLOAD 32
 
 // Heap boundaries
 static uint32_t heap_start = 0;
 static uint32_t heap_end = 0;
 static uint32_t heap_max = 0;
 
-// Frist block in our free list
-static block_header_t* first_block = NULL;
+// The physically last block (heap_expand grows it or appends after it)
+static block_header_t* last_block = NULL;
 
 // Stats
 static uint32_t total_allocated = 0;
+static uint32_t total_reclaimed = 0; // bytes heap_trim has handed back to the PMM since boot
 
 // Initial heap size: 1MB, max: 16MB
 #define INITIAL_HEAP_SIZE (1024 * 1024)
-#define MAX_HEAP_SIZE (16 * 1024 * 1024)
+#define MAX_HEAP_SIZE KHEAP_MAX_SIZE
+
+// Trimming: once the free block at the end of the heap reaches HEAP_TRIM_THRESHOLD its pages go back to the PMM, except for
+// HEAP_TRIM_KEEP of slack. The gap between the two is the hysteresis, a workload hovering around one size doesn't map and unmap
+// the same pages on every kmalloc/kfree
+#define HEAP_TRIM_THRESHOLD (256 * 1024)
+#define HEAP_TRIM_KEEP (64 * 1024)
+
+// With TLSF kmalloc/kfree never map or unmap pages themselves when called with interrupts off, that's what keeps them bounded in IRQ
+// context. Called with interrupts on they do a bounded bit of upkeep instead: kfree trims at most HEAP_TRIM_BATCH pages, kmalloc tops
+// the free tail back up to HEAP_TRIM_KEEP (the reserve IRQ-time allocations come out of). kheap_maintain does the same from the idle thread
+#define HEAP_TRIM_BATCH 16
+
+// IF in EFLAGS, tells whether the caller had interrupts enabled
+#define EFLAGS_IF 0x200
+
+// Heap starts above the direct map (KHEAP_START in kheap.h)
+#define HEAP_START_ADDR KHEAP_START
+
+// Small allocations don't go through the block list at all, they come from a slab cache per power-of-two size class (16B - 2KB)
+// which is O(1) no matter how fragmented the heap is. Only bigger requests (and slab failures) fall through to first-fit
+#define KMALLOC_MIN_CLASS 16
+#define KMALLOC_MAX_CLASS 2048
+#define KMALLOC_CLASSES 8
+
+static slab_cache_t kmalloc_caches[KMALLOC_CLASSES];
+static const char* kmalloc_cache_names[KMALLOC_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+// smallest class that fits, size must be in 1..KMALLOC_MAX_CLASS
+static uint32_t size_class(size_t size) {
+    if (size <= KMALLOC_MIN_CLASS) return 0;
+    uint32_t msb;
+    __asm__("bsr %1, %0" : "=r"(msb) : "rm"((uint32_t)size - 1));
+    return msb + 1 - 4; // 2^(msb+1) is the next power of two, class 0 is 2^4
+}
+
+// frames for heap pages come straight from the PMM, paging_map_range pulls them one at a time
+static uint32_t heap_frame_source(void* ctx) {
+    (void)ctx;
+    return (uint32_t)pmm_alloc_frame();
+}
+
+static void heap_frame_sink(uint32_t phys, void* ctx) {
+    (void)ctx;
+    pmm_free_frame((void*)phys);
+}
+
+static block_footer_t* footer_of(block_header_t* block) {
+    return (block_footer_t*)((uint8_t*)block + HEADER_SIZE + block->size);
+}
+
+// write the header's size / free flag into the footer too, needed whenever either changes
+static void sync_footer(block_header_t* block) {
+    block_footer_t* footer = footer_of(block);
+    footer->size = block->size;
+    footer->is_free = block->is_free;
+}
+
+// physical neighbours, NULL at the ends of the heap
+static block_header_t* next_block(block_header_t* block) {
+    uint32_t next = (uint32_t)block + BLOCK_OVERHEAD + block->size;
+    return next < heap_end ? (block_header_t*)next : NULL;
+}
+
+static block_header_t* prev_block(block_header_t* block) {
+    if ((uint32_t)block <= heap_start) return NULL;
+    block_footer_t* footer = (block_footer_t*)block - 1;
+    return (block_header_t*)((uint8_t*)block - footer->size - BLOCK_OVERHEAD);
+}
+
+#ifdef KHEAP_TLSF
+// Two-Level Segregated Fit (make KHEAP_BACKEND=tlsf)
+// Free blocks are binned by size: the first level is the power of two, the second splits each power of two into TLSF_SL_COUNT
+// equal ranges. A bitmap per level says which bins are non-empty, so finding a bin that's guaranteed to fit is a couple of bit
+// scans and insert/remove are list pushes. Nothing depends on how many blocks the heap has, which is what makes kmalloc/kfree
+// safe to call with interrupts off. Sizes below TLSF_SMALL_SIZE all share first level 0, split linearly in 8 byte steps
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 3) // 3 = log2 of the 8 byte payload granularity
+#define TLSF_SMALL_SIZE (1 << TLSF_FL_SHIFT)
+#define TLSF_FL_MAX 24 // largest payload is under 2^24 (the whole 16MB heap)
+#define TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+
+static uint32_t tlsf_fl_bitmap = 0;
+static uint32_t tlsf_sl_bitmap[TLSF_FL_COUNT];
+static block_header_t* tlsf_bins[TLSF_FL_COUNT][TLSF_SL_COUNT];
+
+static uint32_t tlsf_fls(uint32_t x) {
+    uint32_t bit;
+    __asm__("bsr %1, %0" : "=r"(bit) : "rm"(x));
+    return bit;
+}
+
+static uint32_t tlsf_ffs(uint32_t x) {
+    uint32_t bit;
+    __asm__("bsf %1, %0" : "=r"(bit) : "rm"(x));
+    return bit;
+}
+
+// the bin a block of this size lives in
+static void tlsf_mapping(uint32_t size, uint32_t* fl, uint32_t* sl) {
+    if (size < TLSF_SMALL_SIZE) {
+        *fl = 0;
+        *sl = size / (TLSF_SMALL_SIZE / TLSF_SL_COUNT);
+    } else {
+        uint32_t top = tlsf_fls(size);
+        *sl = (size >> (top - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *fl = top - (TLSF_FL_SHIFT - 1);
+    }
+}
+
+static void free_list_insert(block_header_t* block) {
+    uint32_t fl, sl;
+    tlsf_mapping(block->size, &fl, &sl);
+
+    block->prev_free = NULL;
+    block->next_free = tlsf_bins[fl][sl];
+    if (block->next_free) block->next_free->prev_free = block;
+    tlsf_bins[fl][sl] = block;
+
+    tlsf_fl_bitmap |= 1u << fl;
+    tlsf_sl_bitmap[fl] |= 1u << sl;
+}
+
+static void free_list_remove(block_header_t* block) {
+    uint32_t fl, sl;
+    tlsf_mapping(block->size, &fl, &sl);
+
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        tlsf_bins[fl][sl] = block->next_free;
+        if (!tlsf_bins[fl][sl]) {
+            tlsf_sl_bitmap[fl] &= ~(1u << sl);
+            if (!tlsf_sl_bitmap[fl]) tlsf_fl_bitmap &= ~(1u << fl);
+        }
+    }
+    if (block->next_free) block->next_free->prev_free = block->prev_free;
+    block->next_free = block->prev_free = NULL;
+}
+
+// a free block at least this big is sure to be found for a request of size: the search rounds up to the next bin boundary
+// so that anything in the bin it starts from is big enough
+static size_t fit_size(size_t size) {
+    if (size < TLSF_SMALL_SIZE) return size;
+    return size + (1u << (tlsf_fls(size) - TLSF_SL_LOG2)) - 1;
+}
+
+// Find free block that fits, the first non-empty bin from the rounded-up size on. Good fit rather than best fit, but bounded
+static block_header_t* find_free_block(size_t size) {
+    uint32_t fl, sl;
+    tlsf_mapping(fit_size(size), &fl, &sl);
+    if (fl >= TLSF_FL_COUNT) return NULL;
+
+    uint32_t sl_map = tlsf_sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        // nothing left at this power of two, move on to the next non-empty one
+        uint32_t fl_map = tlsf_fl_bitmap & (~0u << (fl + 1));
+        if (!fl_map) return NULL;
+        fl = tlsf_ffs(fl_map);
+        sl_map = tlsf_sl_bitmap[fl];
+    }
+    return tlsf_bins[fl][tlsf_ffs(sl_map)];
+}
 
-// Heap starts at 16MB virtual address (above identity mapped region)
-#define HEAP_START_ADDR 0xC0400000
+#else
+// First fit over one explicit free list (the default)
+static block_header_t* free_list = NULL;
+
+static void free_list_insert(block_header_t* block) {
+    block->prev_free = NULL;
+    block->next_free = free_list;
+    if (free_list) free_list->prev_free = block;
+    free_list = block;
+}
+
+static void free_list_remove(block_header_t* block) {
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        free_list = block->next_free;
+    }
+    if (block->next_free) block->next_free->prev_free = block->prev_free;
+    block->next_free = block->prev_free = NULL;
+}
+
+// first fit takes any block that's big enough
+static size_t fit_size(size_t size) {
+    return size;
+}
+
+// Find free block that fits, first fit over the free list only
+static block_header_t* find_free_block(size_t size) {
+    block_header_t* block = free_list;
+
+    while (block) {
+        if (block->size >= size) {
+            return block;
+        }
+        block = block->next_free;
+    }
+    return NULL;
+}
+#endif
+
+// turn [addr, addr + bytes) into one free block at the end of the heap
+static block_header_t* make_free_block(uint32_t addr, uint32_t bytes) {
+    block_header_t* block = (block_header_t*)addr;
+    block->size = bytes - BLOCK_OVERHEAD;
+    block->is_free = 1;
+    sync_footer(block);
+    free_list_insert(block);
+    return block;
+}
 
 void kheap_init(void) {
+    for (uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+        slab_cache_init(&kmalloc_caches[i], kmalloc_cache_names[i], KMALLOC_MIN_CLASS << i);
+    }
+
     heap_start = HEAP_START_ADDR;
     heap_end = heap_start;
     heap_max = heap_start + MAX_HEAP_SIZE;
 
     // Allocate initial heap pages
-    for (uint32_t i = 0; i < INITIAL_HEAP_SIZE; i += PAGE_SIZE) {
-        void* frame = pmm_alloc_frame();
-        if (!frame) {
-            kprintf("Heap: Failed to allocate frame\n");
-            return;
-        }
-        paging_map_page(heap_start + i, (uint32_t)frame, PAGE_PRESENT | PAGE_WRITE);
+    if (paging_map_range(NULL, heap_start, INITIAL_HEAP_SIZE, PAGE_PRESENT | PAGE_WRITE, heap_frame_source, NULL) < 0) {
+        kprintf("Heap: Failed to allocate frame\n");
+        paging_unmap_range(NULL, heap_start, INITIAL_HEAP_SIZE, heap_frame_sink, NULL);
+        return;
     }
     heap_end = heap_start + INITIAL_HEAP_SIZE;
 
     // initialize first block as one big free block
-    first_block = (block_header_t*)heap_start;
-    first_block->size = INITIAL_HEAP_SIZE - HEADER_SIZE;
-    first_block->is_free = 1;
-    first_block->next = NULL;
+    last_block = make_free_block(heap_start, INITIAL_HEAP_SIZE);
 
     kprintf("Heap: Initialized at 0x%x, size %u KB\n", heap_start, INITIAL_HEAP_SIZE / 1024);
 }
@@ -63,100 +292,219 @@ static int heap_expand(uint32_t min_size) {
         return 0;
     }
 
-    for (uint32_t i = 0; i < expand_size; i+= PAGE_SIZE) {
-        void* frame = pmm_alloc_frame();
-        if (!frame) {
-            return 0;
-        }
-        paging_map_page(heap_end + i, (uint32_t)frame, PAGE_PRESENT | PAGE_WRITE);
-    }
-
-    // Find last block and extend it (or create new block)
-    block_header_t* block = first_block;
-    while (block->next) {
-        block = block->next;
+    // all or nothing, a half-mapped expansion would leak its frames since heap_end doesn't move
+    if (paging_map_range(NULL, heap_end, expand_size, PAGE_PRESENT | PAGE_WRITE, heap_frame_source, NULL) < 0) {
+        paging_unmap_range(NULL, heap_end, expand_size, heap_frame_sink, NULL);
+        return 0;
     }
 
-    if (block->is_free) {
-        // Extend last free block
-        block->size += expand_size;
+    // Extend the last block if it's free (its footer moves to the new end), otherwise the new pages become a free block of their own
+    uint32_t old_end = heap_end;
+    heap_end += expand_size;
+    if (last_block && last_block->is_free) {
+        free_list_remove(last_block); // off and back on, TLSF bins blocks by size
+        last_block->size += expand_size;
+        sync_footer(last_block);
+        free_list_insert(last_block);
     } else {
-        // Create new free block at end
-        block_header_t* new_block = (block_header_t*)heap_end;
-        new_block->size = expand_size - HEADER_SIZE;
-        new_block->is_free = 1;
-        new_block->next = NULL;
-        block->next = new_block;
+        last_block = make_free_block(old_end, expand_size);
     }
-
-    heap_end += expand_size;
     return 1;
 }
 
-// Find free block that fits
-static block_header_t* find_free_block(size_t size) {
-    block_header_t* block = first_block;
+// Give whole pages at the end of the heap back if the trailing free block has grown past the threshold. Never goes below the initial size
+// max_pages bounds how much gets unmapped in one go (0 = no limit), returns the number of pages given back
+static uint32_t heap_trim(uint32_t max_pages) {
+    block_header_t* block = last_block;
+    if (!block || !block->is_free) return 0;
+    if (heap_end - (uint32_t)block < HEAP_TRIM_THRESHOLD) return 0;
+
+    uint32_t new_end = ((uint32_t)block + BLOCK_OVERHEAD + HEAP_TRIM_KEEP + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (new_end < heap_start + INITIAL_HEAP_SIZE) new_end = heap_start + INITIAL_HEAP_SIZE;
+    if (new_end >= heap_end) return 0;
+    if (max_pages && heap_end - new_end > max_pages * PAGE_SIZE) new_end = heap_end - max_pages * PAGE_SIZE;
+
+    // shrink the block first, its footer moves down to the new end
+    free_list_remove(block);
+    block->size = new_end - (uint32_t)block - BLOCK_OVERHEAD;
+    sync_footer(block);
+    free_list_insert(block);
+
+    uint32_t bytes = heap_end - new_end;
+    paging_unmap_range(NULL, new_end, bytes, heap_frame_sink, NULL);
+    heap_end = new_end;
+    total_reclaimed += bytes;
+    return bytes / PAGE_SIZE;
+}
 
-    while (block) {
-        if (block->is_free && block->size >= size) {
-            return block;
-        }
-        block = block->next;
+// kmalloc missed, grow the heap by at least min_size unless that's not allowed from here
+// with TLSF, a caller with interrupts off (an IRQ handler, a cli section) only gets what the reserve has, mapping pages isn't bounded
+static int heap_expand_for(uint32_t min_size, uint32_t irq_flags) {
+#ifdef KHEAP_TLSF
+    if (!(irq_flags & EFLAGS_IF)) {
+        kprintf("Heap: reserve exhausted with interrupts off, can't grow here\n");
+        return 0;
     }
-    return NULL;
+#else
+    (void)irq_flags;
+#endif
+    return heap_expand(min_size);
 }
 
-// Split a block if it's much larger than needed
+#ifdef KHEAP_TLSF
+// grow the free tail back to HEAP_TRIM_KEEP, maps at most that much. 1 if it mapped anything
+static int heap_refill_reserve(void) {
+    uint32_t tail_free = last_block && last_block->is_free ? last_block->size : 0;
+    if (tail_free >= HEAP_TRIM_KEEP) return 0;
+    return heap_expand(HEAP_TRIM_KEEP - tail_free);
+}
+#endif
+
+// Split a (free, on the list) block if it's much larger than needed, the tail stays free and goes on the free list
 static void split_block(block_header_t* block, size_t size) {
     // Only split if remaining space is worth it
-    if (block->size >= size + HEADER_SIZE + 32) {
-        block_header_t* new_block = (block_header_t*)((uint8_t*)block + HEADER_SIZE + size);
-        new_block->size = block->size - size - HEADER_SIZE;
+    if (block->size >= size + BLOCK_OVERHEAD + MIN_SPLIT_PAYLOAD) {
+        block_header_t* new_block = (block_header_t*)((uint8_t*)block + BLOCK_OVERHEAD + size);
+        new_block->size = block->size - size - BLOCK_OVERHEAD;
         new_block->is_free = 1;
-        new_block->next = block->next;
+        sync_footer(new_block);
+        free_list_insert(new_block);
+        if (last_block == block) last_block = new_block;
 
         block->size = size;
-        block->next = new_block;
     }
 }
 
+// hand out a block that's already off the free list, splitting off whatever it doesn't need
+static void* claim_block(block_header_t* block, size_t size) {
+    split_block(block, size);
+
+    block->is_free = 0;
+    sync_footer(block);
+    total_allocated += block->size;
+
+    // Return pointer after header
+    return (void*)((uint8_t*)block + HEADER_SIZE);
+}
+
+// gap in front of an aligned payload has to be either nothing or big enough to become a free block of its own
+#define MIN_ALIGN_LEAD (BLOCK_OVERHEAD + MIN_SPLIT_PAYLOAD)
+
+// bytes to skip from the start of block so the payload lands on an align boundary
+static uint32_t align_lead(block_header_t* block, size_t align) {
+    uint32_t payload = (uint32_t)block + HEADER_SIZE;
+    uint32_t lead = ((payload + align - 1) & ~(align - 1)) - payload;
+    if (lead && lead < MIN_ALIGN_LEAD) {
+        lead += (MIN_ALIGN_LEAD - lead + align - 1) & ~(align - 1);
+    }
+    return lead;
+}
+
+// first fit for an aligned request, the block has to fit size after its lead
+static block_header_t* find_aligned_block(size_t size, size_t align) {
+#ifdef KHEAP_TLSF
+    // no list walk here, ask for enough that the worst-case lead still leaves size
+    return find_free_block(size + align + MIN_ALIGN_LEAD);
+#else
+    block_header_t* block = free_list;
+
+    while (block) {
+        uint32_t lead = align_lead(block, align);
+        if (block->size >= lead + size) {
+            return block;
+        }
+        block = block->next_free;
+    }
+    return NULL;
+#endif
+}
+
 
 void* kmalloc(size_t size) {
     if (size == 0) return NULL;
 
+    if (size <= KMALLOC_MAX_CLASS) {
+        void* obj = slab_alloc(&kmalloc_caches[size_class(size)]);
+        if (obj) return obj;
+        // no memory for a new slab, the heap may still have room
+    }
+
     // Align size to 8 bytes
     size = (size + 7) & ~7;
 
+    // the free lists can't be half-updated when an interrupt handler allocates
+    uint32_t flags = irq_save();
     block_header_t* block = find_free_block(size);
 
     // No suitable block, try to expand heap
     if (!block) {
-        if (!heap_expand(size + HEADER_SIZE)) {
+        if (!heap_expand_for(fit_size(size) + BLOCK_OVERHEAD, flags)) {
+            irq_restore(flags);
             kprintf("Heap: Out of memory!\n");
             return NULL;
         }
         block = find_free_block(size);
-        if (!block) return NULL;
+        if (!block) {
+            irq_restore(flags);
+            return NULL;
+        }
     }
 
-    // Split block if too large
-    split_block(block, size);
+    free_list_remove(block);
+    void* ptr = claim_block(block, size);
+#ifdef KHEAP_TLSF
+    if (flags & EFLAGS_IF) heap_refill_reserve();
+#endif
+    irq_restore(flags);
+    return ptr;
+}
 
-    block->is_free = 0;
-    total_allocated += block->size;
+void* kmalloc_aligned(size_t size, size_t align) {
+    if (size == 0 || (align & (align - 1))) return NULL;
 
-    // Return pointer after header
-    return (void*)((uint8_t*)block + HEADER_SIZE);
-}
+    // everything kmalloc returns is 8-byte aligned already
+    if (align <= 8) return kmalloc(size);
 
-void* kmalloc_aligned(size_t size) {
-    // Allocate extra space to ensure alignment
-    void* ptr = kmalloc(size + PAGE_SIZE);
-    if (!ptr) return NULL;
-    
-    // Align to page boundary
-    uint32_t aligned = ((uint32_t)ptr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    return (void*)aligned;
+    size = (size + 7) & ~7;
+
+    uint32_t flags = irq_save();
+    block_header_t* block = find_aligned_block(size, align);
+    if (!block) {
+        // worst case the new space starts right after an allocated block and needs a full lead in front
+        if (!heap_expand_for(fit_size(size + align + MIN_ALIGN_LEAD) + BLOCK_OVERHEAD, flags)) {
+            irq_restore(flags);
+            kprintf("Heap: Out of memory!\n");
+            return NULL;
+        }
+        block = find_aligned_block(size, align);
+        if (!block) {
+            irq_restore(flags);
+            return NULL;
+        }
+    }
+
+    free_list_remove(block);
+
+    // the gap in front becomes a free block of its own and the aligned block starts right after it
+    uint32_t lead = align_lead(block, align);
+    if (lead) {
+        block_header_t* aligned = (block_header_t*)((uint8_t*)block + lead);
+        aligned->size = block->size - lead;
+        if (last_block == block) last_block = aligned;
+
+        block->size = lead - BLOCK_OVERHEAD;
+        sync_footer(block);
+        free_list_insert(block);
+        block = aligned;
+    }
+
+    // a real block, so plain kfree gives it back
+    void* ptr = claim_block(block, size);
+#ifdef KHEAP_TLSF
+    if (flags & EFLAGS_IF) heap_refill_reserve();
+#endif
+    irq_restore(flags);
+    return ptr;
 }
 
 void* kcalloc(size_t num, size_t size) {
@@ -164,38 +512,26 @@ void* kcalloc(size_t num, size_t size) {
     void* ptr = kmalloc(total);
     
     if (ptr) {
-        // Zero the memory
-        uint8_t* p = (uint8_t*)ptr;
-        for (size_t i = 0; i < total; i++) {
-            p[i] = 0;
-        }
+        memset(ptr, 0, total);
     }
     return ptr;
 }
 
-// Merge adjacent free blocks
-static void merge_free_blocks(void) {
-    block_header_t* block = first_block;
-    
-    while (block && block->next) {
-        if (block->is_free && block->next->is_free) {
-            // Merge with next block
-            block->size += HEADER_SIZE + block->next->size;
-            block->next = block->next->next;
-            // Don't advance - check if we can merge again
-        } else {
-            block = block->next;
-        }
-    }
-}
-
 void kfree(void* ptr) {
     if (!ptr) return;
 
+    // slab objects live in the direct map, heap blocks above it
+    if (slab_owns(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+
     // Get header
     block_header_t* block = (block_header_t*)((uint8_t*)ptr - HEADER_SIZE);
-    
+
+    uint32_t flags = irq_save();
     if (block->is_free) {
+        irq_restore(flags);
         kprintf("Heap: Double free detected!\n");
         return;
     }
@@ -203,14 +539,65 @@ void kfree(void* ptr) {
     block->is_free = 1;
     total_allocated -= block->size;
 
-    // Merge adjacent free blocks
-    merge_free_blocks();
+    // Merge with the physical neighbours if they're free, the footers make this O(1) instead of a walk over the whole heap
+    block_header_t* next = next_block(block);
+    if (next && next->is_free) {
+        free_list_remove(next);
+        block->size += BLOCK_OVERHEAD + next->size;
+        if (last_block == next) last_block = block;
+    }
+
+    block_header_t* prev = prev_block(block);
+    if (prev && prev->is_free) {
+        free_list_remove(prev);
+        prev->size += BLOCK_OVERHEAD + block->size;
+        if (last_block == block) last_block = prev;
+        block = prev;
+    }
+
+    sync_footer(block);
+    free_list_insert(block);
+
+#ifdef KHEAP_TLSF
+    // one batch at most, and never from IRQ context. heap_trim only looks at the tail, so this is O(1) when there's nothing to do
+    if (flags & EFLAGS_IF) heap_trim(HEAP_TRIM_BATCH);
+#else
+    if (block == last_block) heap_trim(0);
+#endif
+    irq_restore(flags);
+}
+
+int kheap_maintain(void) {
+    int work = 0;
+
+    // trim in batches, interrupts get a chance in between
+    uint32_t flags = irq_save();
+    while (heap_trim(HEAP_TRIM_BATCH)) {
+        work = 1;
+        irq_restore(flags);
+        flags = irq_save();
+    }
+
+#ifdef KHEAP_TLSF
+    // keep HEAP_TRIM_KEEP free at the end for allocations that can't grow the heap themselves
+    if (heap_refill_reserve()) work = 1;
+#endif
+    irq_restore(flags);
+    return work;
 }
 
 uint32_t kheap_get_used(void) {
-    return total_allocated;
+    uint32_t used = total_allocated;
+    for (uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+        used += kmalloc_caches[i].in_use * kmalloc_caches[i].object_size;
+    }
+    return used;
 }
 
 uint32_t kheap_get_free(void) {
     return (heap_end - heap_start) - total_allocated;
 }
+
+uint32_t kheap_get_reclaimed(void) {
+    return total_reclaimed;
+}
@@ -4,17 +4,34 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// The heap gets its own window of kernel virtual space above the direct map (see the layout in paging.h)
+// so heap pages can never alias physical memory that someone else reaches through PHYS_TO_VIRT
+#define KHEAP_START 0xF8000000
+#define KHEAP_MAX_SIZE (16 * 1024 * 1024)
+
 void kheap_init(void);
 
+// Blocks bigger than the slab classes come from first fit by default, or TLSF when built with KHEAP_BACKEND=tlsf. With TLSF kmalloc/kfree
+// take bounded time however fragmented the heap is, and are safe from interrupt handlers: with interrupts off they never map or unmap
+// heap pages, an allocation the free blocks can't satisfy fails instead of growing the heap. kmalloc with interrupts on (and kheap_maintain) keeps a reserve for that.
+// Both backends disable interrupts around their bookkeeping, so allocating from an IRQ handler can't corrupt it
+
 void* kmalloc(size_t size);
 
-void* kmalloc_aligned(size_t size);
+// align must be a power of two; the result is an ordinary heap block, free it with kfree
+void* kmalloc_aligned(size_t size, size_t align);
 
 void* kcalloc(size_t num, size_t size);
 
 void kfree(void* ptr);
 
+// housekeeping: gives trailing free pages back to the PMM a batch at a time and, with TLSF, grows the heap back to its reserve.
+// kmalloc/kfree already do a bounded share of this when called with interrupts on, this catches up on the rest. call it from a
+// preemptible thread (the idle-priority one), returns 1 if it did anything
+int kheap_maintain(void);
+
 uint32_t kheap_get_used(void);
 uint32_t kheap_get_free(void);
+uint32_t kheap_get_reclaimed(void); // bytes of heap pages given back to the PMM by trimming, since boot
 
 #endif
\ No newline at end of file
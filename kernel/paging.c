@@ -1,22 +1,34 @@
 /*
 * IMPORTANT!!!!!!
-* The PHYS_TO_VIRT macro only works for physical addresses within the first 16MB (the range mapped by paging_init). 
-* If the PMM ever returns a frame above 16MB and you try to write to it via PHYS_TO_VIRT, it'll page fault. 
-* With 128MB of RAM and the PMM's linear scan, frames are allocated from low addresses first, so this won't be an issue in practice. 
-* But if we later add more RAM support, bump page_tables[4] to page_tables[32] (128MB coverage) and adjust the loop in paging_init accordingly.
+* The PHYS_TO_VIRT macro only works for physical addresses below the end of the direct map (all RAM up to DIRECT_MAP_LIMIT = 896MB,
+* the range mapped by paging_init, see paging_get_direct_map_end).
+* If you write to a frame above that via PHYS_TO_VIRT, it'll page fault (or worse, scribble over whatever is mapped there).
+* The PMM makes sure that doesn't happen by accident: pmm_alloc_frame() and PMM_ALLOC_KERNEL only ever hand out frames from the
+* DMA and normal zones, which are both below DIRECT_MAP_LIMIT. Frames from PMM_ALLOC_HIGH have to go through paging_kmap.
 */
 
 #include "paging.h"
 #include "pmm.h"
+#include "idt.h"
+#include "kheap.h"
 #include "kprintf.h"
+#include "string.h"
 
 // Page dir, must be 4KB aligned
 // Contains 1024 entries, each pointing to a page table
 static page_dir_entry_t page_directory[PAGE_ENTRIES] __attribute__((aligned(4096)));
 
-// Page tables for first 16MB mapped at 0xC0000000 (4 tables x 4MB each)
-// PD indices 768-771
-static page_table_entry_t page_tables[4][PAGE_ENTRIES] __attribute__((aligned(4096)));
+// Physical end of the direct map at 0xC0000000, boot.asm maps the first 16MB and paging_init extends it to cover RAM
+static uint32_t direct_map_end = 0x01000000;
+
+// PAGE_GLOBAL if the CPU has PGE, 0 otherwise. or'd into every kernel-half mapping so switching CR3 doesn't throw the kernel's TLB entries away
+static uint32_t kernel_global = 0;
+
+// Page table for the kmap window (PD index 1023), only the first KMAP_SLOTS entries are ever used
+static page_table_entry_t kmap_table[PAGE_ENTRIES] __attribute__((aligned(4096)));
+
+// 1 bit per kmap slot, set = in use
+static uint32_t kmap_used = 0;
 
 // Pointer to curr page dir (virtual addr for reading/writing)
 static page_dir_entry_t* current_page_directory = NULL;
@@ -30,28 +42,143 @@ void paging_flush_tlb(uint32_t virtual_addr) {
     __asm__ volatile("invlpg (%0)" :: "r"(virtual_addr) : "memory");
 }
 
+#define CR4_PSE 0x10
+#define CR4_PGE 0x80
+#define CR0_WP 0x10000 // write protect: read-only pages fault on writes from ring 0 too, copy-on-write depends on it
+
+static uint32_t read_cr4(void) {
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static void write_cr4(uint32_t cr4) {
+    __asm__ volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+void paging_flush_tlb_all(void) {
+    if (kernel_global) {
+        // toggling CR4.PGE is the one way to drop global entries, it flushes everything
+        uint32_t cr4 = read_cr4();
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        uint32_t cr3;
+        __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+        __asm__ volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    }
+}
+
+// CPUID leaf 1 feature bits in EDX
+#define CPUID_PSE (1u << 3) // page size extension (4MB pages)
+#define CPUID_PGE (1u << 13) // page global enable
+
+static uint32_t cpuid_features(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return edx;
+}
+
+// Page directories and page tables always come from PMM_ALLOC_KERNEL frames, so they're all in the direct map and any address space's
+// tables can be edited through PHYS_TO_VIRT without loading its CR3 first (no recursive slot or temporary window needed)
+static page_dir_entry_t* dir_of(uint32_t* dir_phys) {
+    return dir_phys ? (page_dir_entry_t*)PHYS_TO_VIRT((uint32_t)dir_phys) : page_directory;
+}
+
+// The kernel half is one set of tables shared by every directory, its entries always live in (and get added to) the kernel's
+static page_dir_entry_t* dir_for(page_dir_entry_t* dir, uint32_t virtual_addr) {
+    return virtual_addr >= KERNEL_VIRTUAL_BASE ? page_directory : dir;
+}
+
+// Page table for a PD slot, allocating it if it's missing. NULL if the slot is a 4MB page or we're out of memory
+static page_table_entry_t* get_table(page_dir_entry_t* dir, uint32_t pd_index, uint32_t flags) {
+    if (dir[pd_index] & PAGE_LARGE) {
+        return NULL;
+    }
+    if (!(dir[pd_index] & PAGE_PRESENT)) {
+        // Allocate a new page table (PMM returns physical address)
+        // it has to start out all zeroes (every entry not present), the PMM's pre-zeroed pool usually has one ready
+        uint32_t new_table_phys = (uint32_t)pmm_alloc_zeroed_frame(PMM_ALLOC_KERNEL);
+        if (!new_table_phys) {
+            kprintf("Paging: Failed to allocate page table\n");
+            return NULL;
+        }
+        // Add to page dir (stores physical address, as hardware requires)
+        dir[pd_index] = new_table_phys | PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
+    }
+    return (page_table_entry_t*)PHYS_TO_VIRT(dir[pd_index] & 0xFFFFF000);
+}
+
+// User-half page tables count their live entries in the refcount of their frame's descriptor: 1 for the directory's reference
+// plus one per present PTE. when it's back to 1 the table is empty and goes back to the PMM. kernel tables are shared and never freed
+static page_t* user_table_desc(page_dir_entry_t* dir, uint32_t pd_index) {
+    if (pd_index >= KERNEL_VIRTUAL_BASE >> 22) return NULL;
+    return pmm_frame_desc(dir[pd_index] & 0xFFFFF000);
+}
+
+// Drop an empty user page table. the invlpg also throws out any cached PD entries (paging-structure caches), so the
+// frame can't be walked by the MMU after it's freed. not needed if the directory isn't loaded
+static void free_table(page_dir_entry_t* dir, uint32_t pd_index, int loaded) {
+    uint32_t table_phys = dir[pd_index] & 0xFFFFF000;
+    dir[pd_index] = 0x00000002;
+    if (loaded) {
+        paging_flush_tlb(pd_index << 22);
+    }
+    pmm_free_frame((void*)table_phys);
+}
+
 void paging_init(void) {
     kprintf("Paging: Initializing higher-half mapping...\n");
 
     // Clear the page directory
-    for (int i = 0; i < PAGE_ENTRIES; i++) {
-        page_directory[i] = 0x00000002; // R/W but not present
+    memset32(page_directory, 0x00000002, PAGE_ENTRIES); // R/W but not present
+
+    // Map physical RAM at virtual 0xC0000000 in 4MB chunks (one PD entry each, starting at PD index 768 = 0xC0000000 >> 22)
+    // all of it if it fits below DIRECT_MAP_LIMIT, the rest is high memory. never less than the 16MB boot.asm mapped,
+    // the kernel and the PMM bookkeeping live in there even on a tiny machine
+    uint32_t chunks = (pmm_get_frame_limit() + PAGE_ENTRIES - 1) / PAGE_ENTRIES;
+    if (chunks > DIRECT_MAP_LIMIT / 0x400000) chunks = DIRECT_MAP_LIMIT / 0x400000;
+    if (chunks < 4) chunks = 4;
+
+    // with PSE each chunk is a single 4MB page: no page tables at all, and the whole kernel fits in a handful of TLB entries
+    uint32_t features = cpuid_features();
+    int pse = (features & CPUID_PSE) != 0;
+    if (pse) {
+        write_cr4(read_cr4() | CR4_PSE);
+    }
+
+    // the G bit is harmless until CR4.PGE is set, which happens once the new directory is loaded
+    if (features & CPUID_PGE) {
+        kernel_global = PAGE_GLOBAL;
     }
 
-    // Map first 16MB of physical memory at virtual 0xC0000000
-    // PD index 768 = 0xC0000000 >> 22
-    // PD index 769 = 0xC0400000 >> 22
-    // PD index 770 = 0xC0800000 >> 22
-    // PD index 771 = 0xC0C00000 >> 22
-    for (int t = 0; t < 4; t++) {
+    for (uint32_t c = 0; c < chunks; c++) {
+        uint32_t phys_addr = c * 0x400000;
+        if (pse) {
+            page_directory[768 + c] = phys_addr | PAGE_PRESENT | PAGE_WRITE | PAGE_LARGE | kernel_global;
+            continue;
+        }
+
+        // no PSE, fall back to a page table per 4MB. the tables come from the DMA zone because that's all boot.asm mapped for us,
+        // the normal zone isn't reachable until this direct map is loaded
+        uint32_t table_phys = (uint32_t)pmm_alloc_frame_flags(PMM_ALLOC_DMA);
+        if (!table_phys) {
+            kprintf("Paging: out of memory for direct map tables, stopping at %u MB\n", c * 4);
+            chunks = c;
+            break;
+        }
+        page_table_entry_t* table = (page_table_entry_t*)PHYS_TO_VIRT(table_phys);
         for (int i = 0; i < PAGE_ENTRIES; i++) {
-            uint32_t phys_addr = (t * PAGE_ENTRIES + i) * PAGE_SIZE;
-            page_tables[t][i] = phys_addr | PAGE_PRESENT | PAGE_WRITE;
+            table[i] = (phys_addr + i * PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITE | kernel_global;
         }
         // PD entries store PHYSICAL addresses of page tables
-        page_directory[768 + t] = VIRT_TO_PHYS((uint32_t)&page_tables[t]) | PAGE_PRESENT | PAGE_WRITE;
+        page_directory[768 + c] = table_phys | PAGE_PRESENT | PAGE_WRITE;
     }
 
+    // kmap window, the table starts out empty and paging_kmap fills in slots as needed
+    memset32(kmap_table, 0, PAGE_ENTRIES);
+    page_directory[KMAP_BASE >> 22] = VIRT_TO_PHYS((uint32_t)kmap_table) | PAGE_PRESENT | PAGE_WRITE;
+
     // Store current page dir (virtual address for kernel access)
     current_page_directory = page_directory;
 
@@ -60,37 +187,56 @@ void paging_init(void) {
 
     // Paging was already enabled in boot.asm — we just replaced the page directory.
     // The boot identity map (PD[0]) is now gone. We're purely higher-half.
+    direct_map_end = chunks * 0x400000;
 
-    kprintf("Paging: Loaded, first 16MB mapped at 0xC0000000\n");
+    // the kernel writing into a copy-on-write user page has to fault like a user write would, otherwise it scribbles over the shared frame
+    uint32_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_WP));
+
+    // from here on kernel translations survive CR3 reloads
+    if (kernel_global) {
+        write_cr4(read_cr4() | CR4_PGE);
+    }
+
+    // page tables for the rest of the kernel half (heap and everything above it) exist from the start. directories only copy the
+    // kernel's PD entries when they're created, so a kernel table added later would never show up in address spaces that already exist
+    for (uint32_t pd_index = KHEAP_START >> 22; pd_index < (KMAP_BASE >> 22); pd_index++) {
+        if (!get_table(page_directory, pd_index, 0)) {
+            kprintf("Paging: couldn't preallocate kernel page tables\n");
+            break;
+        }
+    }
+
+    kprintf("Paging: Loaded, first %u MB mapped at 0xC0000000 with %s pages%s\n", chunks * 4, pse ? "4MB" : "4KB", kernel_global ? ", global" : "");
 }
 
 void paging_map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags) {
     uint32_t pd_index = virtual_addr >> 22;
     uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
+    page_dir_entry_t* dir = dir_for(current_page_directory, virtual_addr);
 
-    if (!(page_directory[pd_index] & PAGE_PRESENT)) {
-        // Allocate a new page table (PMM returns physical address)
-        uint32_t new_table_phys = (uint32_t)pmm_alloc_frame();
-        if (!new_table_phys) {
-            kprintf("Paging: Failed to allocate page table\n");
-            return;
-        }
-
-        // Clear the new page table (convert to virtual to write to it)
-        page_table_entry_t* new_table = (page_table_entry_t*)PHYS_TO_VIRT(new_table_phys);
-        for (int i = 0; i < PAGE_ENTRIES; i++) {
-            new_table[i] = 0;
-        }
+    if (dir[pd_index] & PAGE_LARGE) {
+        // inside the direct map, there's no page table to put a 4KB mapping in
+        kprintf("Paging: can't map 0x%x, it's inside a 4MB page\n", virtual_addr);
+        return;
+    }
 
-        // Add to page dir (stores physical address, as hardware requires)
-        page_directory[pd_index] = new_table_phys | PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
+    page_table_entry_t* table = get_table(dir, pd_index, flags);
+    if (!table) {
+        return;
     }
 
-    // Get the page table: PD entry has physical addr, convert to virtual to dereference
-    uint32_t table_phys = page_directory[pd_index] & 0xFFFFF000;
-    page_table_entry_t* table = (page_table_entry_t*)PHYS_TO_VIRT(table_phys);
+    // kernel-half mappings are shared by every address space, so they can be global
+    if (virtual_addr >= KERNEL_VIRTUAL_BASE) {
+        flags |= kernel_global;
+    }
 
     // Map the page
+    page_t* table_page = user_table_desc(dir, pd_index);
+    if (table_page && !(table[pt_index] & PAGE_PRESENT)) {
+        table_page->refcount++;
+    }
     table[pt_index] = (physical_addr & 0xFFFFF000) | (flags & 0xFFF) | PAGE_PRESENT;
 
     paging_flush_tlb(virtual_addr);
@@ -99,28 +245,248 @@ void paging_map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t fla
 void paging_unmap_page(uint32_t virtual_addr) {
     uint32_t pd_index = virtual_addr >> 22;
     uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
+    page_dir_entry_t* dir = dir_for(current_page_directory, virtual_addr);
 
-    if (!(page_directory[pd_index] & PAGE_PRESENT)) {
+    if (!(dir[pd_index] & PAGE_PRESENT) || (dir[pd_index] & PAGE_LARGE)) {
         return;
     }
 
-    uint32_t table_phys = page_directory[pd_index] & 0xFFFFF000;
+    uint32_t table_phys = dir[pd_index] & 0xFFFFF000;
     page_table_entry_t* table = (page_table_entry_t*)PHYS_TO_VIRT(table_phys);
+    if (!(table[pt_index] & PAGE_PRESENT)) {
+        return;
+    }
     table[pt_index] = 0;
 
     paging_flush_tlb(virtual_addr);
+
+    page_t* table_page = user_table_desc(dir, pd_index);
+    if (table_page && --table_page->refcount == 1) {
+        free_table(dir, pd_index, 1);
+    }
+}
+
+// Batched TLB invalidation for the range operations: single invlpgs up to PAGING_INVLPG_THRESHOLD, after that one full flush at the end
+// editing the user half of a directory that isn't loaded needs no invalidation at all, nothing of it can be in the TLB
+typedef struct {
+    uint32_t count; // present entries changed so far
+    int kernel; // range touches the kernel half, a plain CR3 reload won't drop those (global) entries
+    int loaded; // the directory is the one in CR3
+    int stale; // entries past the threshold changed without an invlpg, the TLB needs a full flush
+} tlb_batch_t;
+
+static void tlb_batch_init(tlb_batch_t* batch, page_dir_entry_t* dir, uint32_t end) {
+    batch->count = 0;
+    batch->kernel = end > KERNEL_VIRTUAL_BASE;
+    batch->loaded = dir == current_page_directory;
+    batch->stale = 0;
+}
+
+static void tlb_batch_add(tlb_batch_t* batch, uint32_t virtual_addr) {
+    if (!batch->loaded && virtual_addr < KERNEL_VIRTUAL_BASE) return;
+
+    if (++batch->count <= PAGING_INVLPG_THRESHOLD) {
+        paging_flush_tlb(virtual_addr);
+    } else {
+        batch->stale = 1;
+    }
+}
+
+static void tlb_batch_finish(tlb_batch_t* batch) {
+    if (!batch->stale) return;
+
+    if (batch->kernel) {
+        paging_flush_tlb_all();
+    } else {
+        uint32_t cr3;
+        __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+        __asm__ volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    }
+    batch->stale = 0;
+}
+
+int paging_map_range(uint32_t* dir_phys, uint32_t virtual_addr, uint32_t size, uint32_t flags, paging_frame_source_t source, void* ctx) {
+    page_dir_entry_t* dir = dir_of(dir_phys);
+    uint32_t end = virtual_addr + size;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, dir, end);
+    if (virtual_addr >= KERNEL_VIRTUAL_BASE) {
+        flags |= kernel_global;
+    }
+
+    int result = 0;
+    uint32_t addr = virtual_addr;
+    while (addr < end) {
+        page_dir_entry_t* pd = dir_for(dir, addr);
+        uint32_t pd_index = addr >> 22;
+        page_table_entry_t* table = get_table(pd, pd_index, flags);
+        if (!table) {
+            if (pd[pd_index] & PAGE_LARGE) {
+                kprintf("Paging: can't map 0x%x, it's inside a 4MB page\n", addr);
+            }
+            result = -1;
+            break;
+        }
+
+        // fill this table up to its end or the end of the range, whichever comes first
+        page_t* table_page = user_table_desc(pd, pd_index);
+        uint32_t table_end = (addr & 0xFFC00000) + 0x400000;
+        if (table_end > end || table_end == 0) table_end = end;
+        for (; addr < table_end; addr += PAGE_SIZE) {
+            uint32_t frame = source(ctx);
+            if (!frame) {
+                result = -1;
+                break;
+            }
+            page_table_entry_t* pte = &table[(addr >> 12) & 0x3FF];
+            // only entries that were present can be sitting in the TLB
+            if (*pte & PAGE_PRESENT) {
+                tlb_batch_add(&batch, addr);
+            } else if (table_page) {
+                table_page->refcount++;
+            }
+            *pte = (frame & 0xFFFFF000) | (flags & 0xFFF) | PAGE_PRESENT;
+        }
+        // the source can run dry right after we allocated a fresh table, don't leave it behind empty
+        if (table_page && table_page->refcount == 1) {
+            free_table(pd, pd_index, batch.loaded);
+        }
+        if (result < 0) break;
+    }
+
+    tlb_batch_finish(&batch);
+    return result;
+}
+
+// frames collected by paging_unmap_range before they go to the sink, they can't be handed back until the TLB is clean
+#define UNMAP_BATCH 128
+
+uint32_t paging_unmap_range(uint32_t* dir_phys, uint32_t virtual_addr, uint32_t size, paging_frame_sink_t sink, void* ctx) {
+    page_dir_entry_t* dir = dir_of(dir_phys);
+    uint32_t end = virtual_addr + size;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, dir, end);
+    uint32_t frames[UNMAP_BATCH];
+    uint32_t pending = 0;
+    uint32_t unmapped = 0;
+
+    uint32_t addr = virtual_addr;
+    while (addr < end) {
+        page_dir_entry_t* pd = dir_for(dir, addr);
+        uint32_t pd_index = addr >> 22;
+        uint32_t table_end = (addr & 0xFFC00000) + 0x400000;
+        if (table_end > end || table_end == 0) table_end = end;
+
+        // nothing mapped in this 4MB, skip straight to the next table (4MB pages aren't ours to take down either)
+        if (!(pd[pd_index] & PAGE_PRESENT) || (pd[pd_index] & PAGE_LARGE)) {
+            addr = table_end;
+            continue;
+        }
+
+        page_table_entry_t* table = (page_table_entry_t*)PHYS_TO_VIRT(pd[pd_index] & 0xFFFFF000);
+        page_t* table_page = user_table_desc(pd, pd_index);
+        for (; addr < table_end; addr += PAGE_SIZE) {
+            page_table_entry_t* pte = &table[(addr >> 12) & 0x3FF];
+            if (!(*pte & PAGE_PRESENT)) continue;
+
+            uint32_t frame = *pte & 0xFFFFF000;
+            *pte = 0;
+            tlb_batch_add(&batch, addr);
+            unmapped++;
+            if (table_page) table_page->refcount--;
+
+            if (sink) {
+                frames[pending++] = frame;
+                if (pending == UNMAP_BATCH) {
+                    tlb_batch_finish(&batch);
+                    for (uint32_t i = 0; i < pending; i++) sink(frames[i], ctx);
+                    pending = 0;
+                }
+            }
+        }
+
+        // that was the last live entry, the whole table can go
+        if (table_page && table_page->refcount == 1) {
+            free_table(pd, pd_index, batch.loaded);
+        }
+    }
+
+    tlb_batch_finish(&batch);
+    for (uint32_t i = 0; i < pending; i++) sink(frames[i], ctx);
+    return unmapped;
+}
+
+int paging_share_range(uint32_t* src_phys, uint32_t* dst_phys, uint32_t virtual_addr, uint32_t size, paging_frame_sink_t share, void* ctx) {
+    page_dir_entry_t* src = dir_of(src_phys);
+    page_dir_entry_t* dst = dir_of(dst_phys);
+    uint32_t end = virtual_addr + size;
+    if (end < virtual_addr || end > KERNEL_VIRTUAL_BASE) {
+        kprintf("Paging: can't share 0x%x-0x%x, only user-half ranges can be shared\n", virtual_addr, end);
+        return -1;
+    }
+
+    // src loses write access, which has to reach its TLB entries if it's loaded. dst's entries are brand new
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, src, end);
+    int dst_loaded = dst == current_page_directory;
+
+    int result = 0;
+    uint32_t addr = virtual_addr;
+    while (addr < end) {
+        uint32_t pd_index = addr >> 22;
+        uint32_t table_end = (addr & 0xFFC00000) + 0x400000;
+        if (table_end > end) table_end = end;
+
+        if (!(src[pd_index] & PAGE_PRESENT) || (src[pd_index] & PAGE_LARGE)) {
+            addr = table_end;
+            continue;
+        }
+
+        page_table_entry_t* from = (page_table_entry_t*)PHYS_TO_VIRT(src[pd_index] & 0xFFFFF000);
+        page_table_entry_t* to = get_table(dst, pd_index, src[pd_index] & PAGE_USER);
+        if (!to) {
+            result = -1;
+            break;
+        }
+        page_t* to_page = user_table_desc(dst, pd_index);
+        for (; addr < table_end; addr += PAGE_SIZE) {
+            uint32_t i = (addr >> 12) & 0x3FF;
+            if (!(from[i] & PAGE_PRESENT)) continue;
+
+            if (from[i] & PAGE_WRITE) {
+                from[i] &= ~PAGE_WRITE;
+                tlb_batch_add(&batch, addr);
+            }
+            if (!(to[i] & PAGE_PRESENT) && to_page) to_page->refcount++;
+            to[i] = from[i];
+            if (share) share(from[i] & 0xFFFFF000, ctx);
+        }
+        // nothing was present in this table, don't leave dst an empty one
+        if (to_page && to_page->refcount == 1) {
+            free_table(dst, pd_index, dst_loaded);
+        }
+    }
+
+    tlb_batch_finish(&batch);
+    return result;
 }
 
 uint32_t paging_get_physical(uint32_t virtual_addr) {
     uint32_t pd_index = virtual_addr >> 22;
     uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
     uint32_t offset = virtual_addr & 0xFFF;
+    page_dir_entry_t* dir = dir_for(current_page_directory, virtual_addr);
 
-    if (!(page_directory[pd_index] & PAGE_PRESENT)) {
+    if (!(dir[pd_index] & PAGE_PRESENT)) {
         return 0;
     }
 
-    uint32_t table_phys = page_directory[pd_index] & 0xFFFFF000;
+    // 4MB page, the PD entry holds the physical base directly
+    if (dir[pd_index] & PAGE_LARGE) {
+        return (dir[pd_index] & 0xFFC00000) + (virtual_addr & 0x3FFFFF);
+    }
+
+    uint32_t table_phys = dir[pd_index] & 0xFFFFF000;
     page_table_entry_t* table = (page_table_entry_t*)PHYS_TO_VIRT(table_phys);
 
     if (!(table[pt_index] & PAGE_PRESENT)) {
@@ -130,11 +496,19 @@ uint32_t paging_get_physical(uint32_t virtual_addr) {
     return (table[pt_index] & 0xFFFFF000) + offset;
 }
 
+uint32_t paging_get_direct_map_end(void) {
+    return direct_map_end;
+}
+
 uint32_t* paging_get_directory(void) {
     // Return PHYSICAL address (for CR3 and address space tracking)
     return (uint32_t*)VIRT_TO_PHYS((uint32_t)page_directory);
 }
 
+uint32_t* paging_get_loaded_directory(void) {
+    return (uint32_t*)VIRT_TO_PHYS((uint32_t)current_page_directory);
+}
+
 uint32_t* paging_create_directory(void) {
     // Allocate a physical frame for the new page dir
     uint32_t dir_phys = (uint32_t)pmm_alloc_frame();
@@ -147,23 +521,81 @@ uint32_t* paging_create_directory(void) {
     uint32_t* new_dir = (uint32_t*)PHYS_TO_VIRT(dir_phys);
 
     // Start with everything not present
-    for (int i = 0; i < PAGE_ENTRIES; i++) {
-        new_dir[i] = 0x00000002;
-    }
+    memset32(new_dir, 0x00000002, 768);
 
     // Copy ALL kernel-space PD entries (indices 768-1023)
     // This is what makes the kernel accessible from every address space
-    for (int i = 768; i < 1024; i++) {
-        new_dir[i] = page_directory[i];
-    }
+    memcpy(&new_dir[768], &page_directory[768], 256 * sizeof(uint32_t));
 
     // Return PHYSICAL address (for storing in address space and loading into CR3)
     return (uint32_t*)dir_phys;
 }
 
+void paging_destroy_directory(uint32_t* dir_phys) {
+    page_dir_entry_t* dir = dir_of(dir_phys);
+    if (dir == page_directory) {
+        kprintf("Paging: refusing to destroy the kernel page directory\n");
+        return;
+    }
+    if (dir == current_page_directory) {
+        kprintf("Paging: refusing to destroy the loaded page directory\n");
+        return;
+    }
+
+    // the user half's page tables belong to this directory alone, the kernel half is shared and stays
+    for (int i = 0; i < 768; i++) {
+        if ((dir[i] & PAGE_PRESENT) && !(dir[i] & PAGE_LARGE)) {
+            pmm_free_frame((void*)(dir[i] & 0xFFFFF000));
+        }
+    }
+    pmm_free_frame(dir_phys);
+}
+
 void paging_switch_directory(uint32_t* dir_phys) {
     // Store virtual address for kernel access
     current_page_directory = (page_dir_entry_t*)PHYS_TO_VIRT((uint32_t)dir_phys);
-    // Load physical address into CR3
+    // Load physical address into CR3, this drops the user half of the TLB but global kernel entries stay put
     paging_load_directory((page_dir_entry_t*)dir_phys);
 }
+
+void* paging_kmap(uint32_t physical_addr) {
+    uint32_t frame = physical_addr & 0xFFFFF000;
+    if (frame < direct_map_end) {
+        return (void*)PHYS_TO_VIRT(physical_addr);
+    }
+
+    uint32_t flags = irq_save();
+    if (kmap_used == (uint32_t)((1ULL << KMAP_SLOTS) - 1)) {
+        irq_restore(flags);
+        kprintf("Paging: out of kmap slots\n");
+        return NULL;
+    }
+
+    // lowest free slot
+    uint32_t slot = 0;
+    while (kmap_used & (1u << slot)) {
+        slot++;
+    }
+    kmap_used |= 1u << slot;
+
+    uint32_t virtual_addr = KMAP_BASE + slot * PAGE_SIZE;
+    kmap_table[slot] = frame | PAGE_PRESENT | PAGE_WRITE | kernel_global;
+    paging_flush_tlb(virtual_addr);
+    irq_restore(flags);
+
+    return (void*)(virtual_addr + (physical_addr & 0xFFF));
+}
+
+void paging_kunmap(void* virtual_addr) {
+    uint32_t addr = (uint32_t)virtual_addr & 0xFFFFF000;
+    if (addr < KMAP_BASE || addr >= KMAP_BASE + KMAP_SLOTS * PAGE_SIZE) {
+        return; // direct-mapped, nothing to undo
+    }
+
+    uint32_t slot = (addr - KMAP_BASE) / PAGE_SIZE;
+    uint32_t flags = irq_save();
+    kmap_table[slot] = 0;
+    paging_flush_tlb(addr);
+    kmap_used &= ~(1u << slot);
+    irq_restore(flags);
+}
@@ -12,12 +12,31 @@
 #define PHYS_TO_VIRT(addr) ((uint32_t)(addr) + KERNEL_VIRTUAL_BASE)
 #define VIRT_TO_PHYS(addr) ((uint32_t)(addr) - KERNEL_VIRTUAL_BASE)
 
+// Kernel virtual layout (everything from KERNEL_VIRTUAL_BASE up is shared by all address spaces)
+//   0xC0000000 - direct map of physical memory (up to 896MB), PHYS_TO_VIRT / VIRT_TO_PHYS work in here
+//   0xF8000000 - kernel heap (KHEAP_START, up to 16MB)
+//   0xF9000000 - vmalloc window (VMALLOC_START), virtually contiguous kernel buffers backed by scattered frames
+//   0xFFC00000 - kmap window for temporary mappings of high memory
+// Page tables for everything from KHEAP_START up are allocated in paging_init and never freed, so every directory shares them
+
+// Physical memory below this is permanently mapped at KERNEL_VIRTUAL_BASE, so PHYS_TO_VIRT only works for frames under it
+// (paging_init maps min(RAM, DIRECT_MAP_LIMIT), see paging_get_direct_map_end). it's the room between KERNEL_VIRTUAL_BASE and the heap
+// The PMM's normal zone ends here, anything above is high memory and has to go through paging_kmap
+#define DIRECT_MAP_LIMIT 0x38000000
+
+// Temporary mapping window for frames outside the direct map, in the last 4MB of the address space
+// (PD index 1023, the page table is shared by every address space like the rest of the kernel half)
+#define KMAP_BASE 0xFFC00000
+#define KMAP_SLOTS 32
+
 // Page directory/entry flags
 #define PAGE_PRESENT 0x001 // Page is present in memory
 #define PAGE_WRITE 0x002 // Page is writable (0 = read-only)
 #define PAGE_USER 0x004 // Page is accessible from user mode
 #define PAGE_ACCESSED 0x020 // CPU sets this when page is accessed
 #define PAGE_DIRTY 0x040 // CPU sets this when page is written to
+#define PAGE_LARGE 0x080 // PD entry maps a 4MB page directly instead of pointing to a page table (needs CR4.PSE)
+#define PAGE_GLOBAL 0x100 // translation survives CR3 reloads (needs CR4.PGE), set on everything in the shared kernel half
 
 // # of entries in page dir and page tables
 #define PAGE_ENTRIES 1024
@@ -31,26 +50,76 @@ typedef uint32_t page_table_entry_t;
 // Init paging with higher-half mapping for kernel
 void paging_init(void);
 
+// Single-page operations on the directory that's currently loaded
 // Map a virtual addr to a physical addr
 void paging_map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags);
 
 // Unmap a virtual addr
 void paging_unmap_page(uint32_t virtual_addr);
 
+// Range operations, for anything bigger than a page. They walk each page table once, step over missing page tables 4MB at a time,
+// and once more than PAGING_INVLPG_THRESHOLD present entries change they stop doing one invlpg per page and flush the whole TLB instead
+#define PAGING_INVLPG_THRESHOLD 32
+
+// hands out the physical frame for the next page of a paging_map_range, 0 = no more frames (out of memory)
+typedef uint32_t (*paging_frame_source_t)(void* ctx);
+
+// gets the physical frame of every page paging_unmap_range took down, called only after the TLB no longer holds the old mapping
+typedef void (*paging_frame_sink_t)(uint32_t physical_addr, void* ctx);
+
+// Both work on any page directory (PHYSICAL address, NULL for the kernel's), loaded or not, without switching CR3
+// kernel-half addresses always go to the shared kernel tables whichever directory is passed
+
+// map [virtual_addr, virtual_addr + size) page by page with frames from source. both need to be page-aligned
+// returns 0 on success, -1 if the source ran dry or a page table couldn't be allocated. whatever got mapped before that stays mapped,
+// so the caller can undo it with paging_unmap_range
+int paging_map_range(uint32_t* dir, uint32_t virtual_addr, uint32_t size, uint32_t flags, paging_frame_source_t source, void* ctx);
+
+// unmap every present page in [virtual_addr, virtual_addr + size), sink (may be NULL) gets each frame that was mapped there
+// returns the number of pages unmapped
+uint32_t paging_unmap_range(uint32_t* dir, uint32_t virtual_addr, uint32_t size, paging_frame_sink_t sink, void* ctx);
+
+// copy-on-write sharing: every present page of [virtual_addr, virtual_addr + size) in src gets mapped at the same address in dst,
+// read-only in both (src's entries lose PAGE_WRITE). share (may be NULL) gets each frame so the caller can take a reference on it
+// user half only. returns 0 on success, -1 if dst needed a page table and there was no memory, pages shared until then stay shared
+int paging_share_range(uint32_t* src, uint32_t* dst, uint32_t virtual_addr, uint32_t size, paging_frame_sink_t share, void* ctx);
+
 // Get physical addr for a virtual addr (returns 0 if not mapped)
 uint32_t paging_get_physical(uint32_t virtual_addr);
 
-// Flush TLB for a specific address
+// end of the physical range the direct map actually covers (16MB until paging_init has run, the boot page tables map that much)
+uint32_t paging_get_direct_map_end(void);
+
+// Flush TLB for a specific address (global entries included)
 void paging_flush_tlb(uint32_t virtual_addr);
 
-// get PHYSICAL address of the curr page dir (for CR3 / address space tracking)
+// Flush the whole TLB, global kernel entries included. a CR3 reload alone keeps global entries,
+// so this is what to use after changing kernel mappings in bulk
+void paging_flush_tlb_all(void);
+
+// get PHYSICAL address of the kernel's page dir (what the kernel address space wraps), whatever CR3 holds right now
 uint32_t* paging_get_directory(void);
 
+// get PHYSICAL address of the page dir that's loaded in CR3 at the moment
+uint32_t* paging_get_loaded_directory(void);
+
 // create a brand new page dir, allocates a 4KB frame for the dir, clears it out,
 // and copies over all the kernel-space entries. Returns PHYSICAL address.
 uint32_t* paging_create_directory(void);
 
+// free a directory from paging_create_directory along with its user-half page tables (not the frames they map, unmap those first)
+// it must not be loaded
+void paging_destroy_directory(uint32_t* dir);
+
 // switch the active page dir by loading a new PHYSICAL address into CR3
+// only the user half of the TLB is lost, kernel translations are global when the CPU supports PGE
 void paging_switch_directory(uint32_t* dir);
 
+// get a kernel virtual address for any physical frame. direct-mapped frames just come back as PHYS_TO_VIRT,
+// high memory frames get one of KMAP_SLOTS temporary slots until paging_kunmap. keep the window short, there aren't many slots
+void* paging_kmap(uint32_t physical_addr);
+
+// release a mapping from paging_kmap (no-op for direct-mapped addresses)
+void paging_kunmap(void* virtual_addr);
+
 #endif
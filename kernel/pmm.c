@@ -1,12 +1,86 @@
 #include "pmm.h"
+#include "paging.h"
+#include "idt.h"
 #include "kprintf.h"
+#include "string.h"
 
 
-// Bit map to track page frames (1 bit per 4KB page)
-// We'll place the bitmap at a fixed location after the kernel
-// For now, support up to 128MB of RAM (32768 pages = 4096 bytes bitmap)
-#define MAX_FRAMES 32786
-static uint8_t frame_bitmap[MAX_FRAMES / 8];
+// Bit map to track page frames (1 bit per 4KB page, 1 = used)
+// It's sized at boot from the highest usable address in the memory map and placed right after the kernel image,
+// so a 64MB machine pays 2KB for it and a 4GB machine 128KB, instead of a fixed .bss array that caps RAM at 128MB
+
+// The bitmap is stored as 32-bit words so whole words of frames can be marked at once
+// It's the ground truth for "is this frame handed out", the buddy free areas below decide what to hand out next
+static uint32_t* frame_bitmap = NULL;
+static uint32_t bitmap_words = 0;
+
+// Binary buddy allocator
+// Free memory is kept as naturally aligned blocks of 2^order frames. Allocating takes the smallest free block that fits and splits it in half
+// until it has the right order, the unused halves ("buddies") go back on the lower orders. Freeing does the reverse: as long as the
+// buddy of the freed block is also free, the two merge into one block of the next order up.
+
+// Each order's free blocks are tracked with a two-level bitmap instead of linked lists, the page descriptors are kept at 4 bytes so
+// there's no room for list links in them and the frames themselves aren't all mapped. Same trick as the old single-frame search:
+// map bit set = block is free at this order, summary bit set = that map word has at least one free block, so bsf finds one fast
+typedef struct {
+    uint32_t* map; // 1 bit per block of this order, set = free
+    uint32_t* summary; // 1 bit per map word, set = that word is non-zero
+    uint32_t words; // map words covering usable RAM
+    uint32_t hint; // next-fit: map word where the last search succeeded
+    uint32_t free_blocks; // number of set bits in map
+} free_area_t;
+
+// Zones
+// Not all physical memory is equal: ISA DMA can only reach the first 16MB, and only frames below DIRECT_MAP_LIMIT are permanently
+// mapped at KERNEL_VIRTUAL_BASE (PHYS_TO_VIRT only works for those). Each zone runs its own buddy allocator, and the allocation flags
+// decide which zone a request starts at. Requests fall back towards ZONE_DMA, never up, so a page table can't end up in high memory.
+// Zone boundaries are multiples of 4MB, so a buddy block never straddles two zones.
+typedef enum {
+    ZONE_DMA = 0, // below 16MB, for ISA DMA (and everything else when the rest is gone)
+    ZONE_NORMAL, // 16MB up to DIRECT_MAP_LIMIT, always reachable through PHYS_TO_VIRT
+    ZONE_HIGH, // above DIRECT_MAP_LIMIT, needs a temporary mapping (paging_kmap) to be touched by the kernel
+    ZONE_COUNT,
+} zone_id_t;
+
+typedef struct {
+    const char* name;
+    uint32_t start_frame; // first frame of the zone, aligned to 2^PMM_MAX_ORDER
+    uint32_t end_frame; // one past the last frame
+    uint32_t total_frames; // usable frames in the zone
+    uint32_t free_frames;
+    free_area_t areas[PMM_MAX_ORDER + 1]; // buddy free areas, block numbers are relative to start_frame
+} zone_t;
+
+static zone_t zones[ZONE_COUNT] = {
+    { .name = "DMA" },
+    { .name = "Normal" },
+    { .name = "High" },
+};
+
+#define DMA_ZONE_LIMIT 0x1000000
+
+// Per-frame descriptors, indexed by frame number, frames [0, max_frame)
+// refcount mirrors the bitmap for everything the allocator manages (0 = free), reserved frames are flagged and left alone
+static page_t* frame_descs = NULL;
+
+// One past the highest usable frame, nothing at or above this is ever free
+static uint32_t max_frame = 0;
+
+// Early bump allocator
+// pmm_init runs before paging_init and before the heap exists, so the bitmap and free area maps are carved out of the RAM
+// right after the kernel image. Nothing here is ever freed, the PMM just treats everything below early_next as part of the kernel.
+// Only the first 16MB are mapped at this point (boot.asm's temporary page tables), so that's as far as we can go
+#define EARLY_MAPPED_LIMIT 0x1000000
+static uint32_t early_next = 0; // physical addr of the next free byte
+
+static void* early_alloc(uint32_t size) {
+    uint32_t addr = (early_next + 3) & ~3u;
+    if (addr + size > EARLY_MAPPED_LIMIT) {
+        return NULL;
+    }
+    early_next = addr + size;
+    return (void*)PHYS_TO_VIRT(addr);
+}
 
 // Stats
 static uint32_t total_frames = 0;
@@ -15,42 +89,190 @@ static uint32_t used_frames = 0;
 // Kernel end addr (defined in linker)
 extern uint32_t _kernel_end;
 
-// Helper to set a frame as used
-static void bitmap_set(uint32_t frame) {
-    frame_bitmap[frame / 8] |= (1 << (frame % 8));
+// Index of the lowest set bit, value must be non-zero
+static inline uint32_t bit_scan_forward(uint32_t value) {
+    uint32_t index;
+    __asm__("bsf %1, %0" : "=r"(index) : "rm"(value));
+    return index;
 }
 
-// Helper to set a frame as free
-static void bitmap_clear(uint32_t frame) {
-    frame_bitmap[frame / 8] &= ~(1 << (frame % 8));
+// Helper to set a range of frames as used
+static void bitmap_set_range(uint32_t frame, uint32_t count) {
+    for (uint32_t f = frame; f < frame + count; f++) {
+        if (!(f % 32) && f + 32 <= frame + count) {
+            frame_bitmap[f / 32] = 0xFFFFFFFF;
+            f += 31;
+            continue;
+        }
+        frame_bitmap[f / 32] |= (1u << (f % 32));
+    }
+}
+
+// Helper to set a range of frames as free
+static void bitmap_clear_range(uint32_t frame, uint32_t count) {
+    for (uint32_t f = frame; f < frame + count; f++) {
+        if (!(f % 32) && f + 32 <= frame + count) {
+            frame_bitmap[f / 32] = 0;
+            f += 31;
+            continue;
+        }
+        frame_bitmap[f / 32] &= ~(1u << (f % 32));
+    }
 }
 
 // Helper to check if frame is used
 static int bitmap_test(uint32_t frame) {
-    return frame_bitmap[frame / 8] & (1 << (frame % 8));
-}
-
-// Find first free frame
-static int bitmap_first_free(void) {
-    for (uint32_t i = 0; i < total_frames / 8; i++) {
-        if (frame_bitmap[i] != 0xFF) {
-            // At least one bit is free in this byte
-            for (int j = 0; j < 8; j++) {
-                if (!(frame_bitmap[i] & (1 << j))) {
-                    return i * 8 + j;
-                }
-            }
+    return (frame_bitmap[frame / 32] & (1u << (frame % 32))) != 0;
+}
+
+static void area_set(free_area_t* area, uint32_t block) {
+    uint32_t word = block / 32;
+    area->map[word] |= (1u << (block % 32));
+    area->summary[word / 32] |= (1u << (word % 32));
+    area->free_blocks++;
+}
+
+static void area_clear(free_area_t* area, uint32_t block) {
+    uint32_t word = block / 32;
+    area->map[word] &= ~(1u << (block % 32));
+    if (!area->map[word]) {
+        area->summary[word / 32] &= ~(1u << (word % 32));
+    }
+    area->free_blocks--;
+}
+
+static int area_test(free_area_t* area, uint32_t block) {
+    if (block / 32 >= area->words) return 0;
+    return (area->map[block / 32] & (1u << (block % 32))) != 0;
+}
+
+// Find a map word with a free block in summary words [from, to), -1 if there is none
+static int summary_find(free_area_t* area, uint32_t from, uint32_t to) {
+    for (uint32_t s = from; s < to; s++) {
+        if (area->summary[s]) {
+            return s * 32 + bit_scan_forward(area->summary[s]);
         }
     }
-    return -1; // No free frames
+    return -1;
 }
 
-void pmm_init(multiboot_info_t* mbi) {
-    // First, mark ALL frames as used (safe default)
-    for (uint32_t i = 0; i < MAX_FRAMES / 8; i++) {
-        frame_bitmap[i] = 0xFF;
+// Find a free block at this order, starting at the next-fit hint and wrapping around once
+static int area_find(free_area_t* area) {
+    if (!area->free_blocks) return -1;
+
+    uint32_t summary_words = (area->words + 31) / 32;
+    uint32_t hint = area->hint;
+
+    // First look at the hint word and the words after it that share its summary word,
+    // then the rest of the summary, then wrap around to the words below the hint
+    uint32_t first = hint / 32;
+    uint32_t masked = area->summary[first] & (0xFFFFFFFF << (hint % 32));
+    int word;
+    if (masked) {
+        word = first * 32 + bit_scan_forward(masked);
+    } else {
+        word = summary_find(area, first + 1, summary_words);
+        if (word < 0) {
+            word = summary_find(area, 0, first + 1);
+        }
     }
+    if (word < 0) return -1;
+
+    area->hint = word;
+    return word * 32 + bit_scan_forward(area->map[word]);
+}
+
+// Words needed for the free area maps and summaries of every order, for frames [0, frames)
+static uint32_t buddy_storage_words(uint32_t frames) {
+    uint32_t total = 0;
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        uint32_t words = ((frames + (1u << order) - 1) >> order) / 32 + 1;
+        total += words + words / 32 + 1;
+    }
+    return total;
+}
+
+// Carve a zone's maps for every order out of storage, returns the first word after them
+static uint32_t* buddy_setup(zone_t* zone, uint32_t* storage) {
+    uint32_t* next = storage;
+    uint32_t frames = zone->end_frame - zone->start_frame;
+
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        free_area_t* area = &zone->areas[order];
+        area->words = ((frames + (1u << order) - 1) >> order) / 32 + 1;
+        area->map = next;
+        next += area->words;
+        area->summary = next;
+        next += area->words / 32 + 1;
+        area->hint = 0;
+        area->free_blocks = 0;
+    }
+
+    memset32(storage, 0, next - storage);
+    return next;
+}
+
+// Hand the free frames [start, end) to the zone's buddy allocator as the largest aligned blocks that fit
+static void buddy_add_range(zone_t* zone, uint32_t start, uint32_t end) {
+    zone->total_frames += end - start;
+    zone->free_frames += end - start;
 
+    start -= zone->start_frame;
+    end -= zone->start_frame;
+    while (start < end) {
+        uint32_t order = PMM_MAX_ORDER;
+        while (order > 0 && ((start & ((1u << order) - 1)) || start + (1u << order) > end)) {
+            order--;
+        }
+        area_set(&zone->areas[order], start >> order);
+        start += 1u << order;
+    }
+}
+
+static zone_t* zone_of(uint32_t frame) {
+    for (int z = 0; z < ZONE_COUNT; z++) {
+        if (frame >= zones[z].start_frame && frame < zones[z].end_frame) {
+            return &zones[z];
+        }
+    }
+    return NULL;
+}
+
+// Split [0, max_frame) into the three zones, any of them can end up empty on a small machine
+static void zones_setup(void) {
+    uint32_t dma_end = DMA_ZONE_LIMIT / PAGE_SIZE;
+    uint32_t normal_end = DIRECT_MAP_LIMIT / PAGE_SIZE;
+
+    if (dma_end > max_frame) dma_end = max_frame;
+    if (normal_end < dma_end) normal_end = dma_end;
+    if (normal_end > max_frame) normal_end = max_frame;
+
+    zones[ZONE_DMA].start_frame = 0;
+    zones[ZONE_DMA].end_frame = dma_end;
+    zones[ZONE_NORMAL].start_frame = dma_end;
+    zones[ZONE_NORMAL].end_frame = normal_end;
+    zones[ZONE_HIGH].start_frame = normal_end;
+    zones[ZONE_HIGH].end_frame = max_frame;
+}
+
+// Clamp a memory map entry to the 32-bit physical address space and return its frame range
+// Returns 0 if nothing of it is usable below 4GB
+static int mmap_entry_frames(multiboot_mmap_entry_t* entry, uint32_t* start_frame, uint32_t* end_frame) {
+    uint64_t base = entry->base_addr;
+    uint64_t end = entry->base_addr + entry->length;
+
+    if (base >= 0x100000000ULL) return 0;
+    if (end > 0x100000000ULL) end = 0x100000000ULL;
+
+    // Align base up and end down to page boundaries
+    *start_frame = (uint32_t)((base + PAGE_SIZE - 1) >> 12);
+    *end_frame = (uint32_t)(end >> 12);
+    return *start_frame < *end_frame;
+}
+
+#define MMAP_NEXT(entry) ((multiboot_mmap_entry_t*)((uint32_t)(entry) + (entry)->size + sizeof((entry)->size)))
+
+void pmm_init(multiboot_info_t* mbi) {
     // Check if memory map is available
     if (!(mbi->flags & MULTIBOOT_FLAG_MMAP)) {
         kprintf("PMM: No memory map available\n");
@@ -59,77 +281,413 @@ void pmm_init(multiboot_info_t* mbi) {
 
     kprintf("PMM: Parsing memory map...\n");
 
+    multiboot_mmap_entry_t* mmap_start = (multiboot_mmap_entry_t*)mbi->mmap_addr;
+    uint32_t mmap_end = mbi->mmap_addr + mbi->mmap_length;
+
+    // First pass: find the highest usable frame so we know how big the bitmap has to be
+    for (multiboot_mmap_entry_t* mmap = mmap_start; (uint32_t)mmap < mmap_end; mmap = MMAP_NEXT(mmap)) {
+        uint32_t start_frame, end_frame;
+        if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE && mmap_entry_frames(mmap, &start_frame, &end_frame)) {
+            if (end_frame > max_frame) {
+                max_frame = end_frame;
+            }
+        }
+    }
+
     // _kernel_end is a virtual address(0xC01xxxxx) - convert to physical
     // for comparison with physical frame addresses
-    uint32_t kernel_end = ((uint32_t)&_kernel_end - 0xC0000000 + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    early_next = VIRT_TO_PHYS(&_kernel_end);
 
-    // Parse memory map and mark available regions as free
-    multiboot_mmap_entry_t* mmap = (multiboot_mmap_entry_t*)mbi->mmap_addr;
-    uint32_t mmap_end = mbi->mmap_addr + mbi->mmap_length;
+    // GRUB is free to put the multiboot info and the memory map right behind the kernel,
+    // don't let the bump allocator overwrite them before we're done reading
+    if (mbi->mmap_addr >= early_next && mmap_end <= EARLY_MAPPED_LIMIT) {
+        early_next = mmap_end;
+    }
+    if ((uint32_t)mbi >= early_next && (uint32_t)mbi + sizeof(multiboot_info_t) <= EARLY_MAPPED_LIMIT) {
+        early_next = (uint32_t)mbi + sizeof(multiboot_info_t);
+    }
+
+    // Size the bitmap and free areas. If they don't fit in the early mapped window we have to give up on the top of RAM
+    uint32_t* storage = NULL;
+    while (max_frame) {
+        uint32_t saved_next = early_next;
+        zones_setup();
+        uint32_t storage_words = 0;
+        for (int z = 0; z < ZONE_COUNT; z++) {
+            storage_words += buddy_storage_words(zones[z].end_frame - zones[z].start_frame);
+        }
+        bitmap_words = (max_frame + 31) / 32;
+        frame_bitmap = (uint32_t*)early_alloc(bitmap_words * sizeof(uint32_t));
+        storage = (uint32_t*)early_alloc(storage_words * sizeof(uint32_t));
+        frame_descs = (page_t*)early_alloc(max_frame * sizeof(page_t));
+        if (frame_bitmap && storage && frame_descs) break;
+
+        early_next = saved_next;
+        max_frame -= max_frame / 8;
+        kprintf("PMM: frame bookkeeping doesn't fit below 16MB, limiting RAM to %u MB\n", max_frame / 256);
+    }
+    if (!max_frame) {
+        kprintf("PMM: No usable memory found\n");
+        return;
+    }
 
-    while ((uint32_t)mmap < mmap_end) {
-        if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
-            // Calculate frame range for this region
-            uint32_t base = (uint32_t)mmap->base_addr;
-            uint32_t length = (uint32_t)mmap->length;
+    // Everything up to here (kernel image + PMM bookkeeping) stays reserved forever
+    uint32_t reserved_end = (early_next + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
-            kprintf("Available: 0x%x - 0x%x (%u KB)\n", base, base + length, length / 1024);
+    // Mark ALL frames as used (safe default)
+    memset32(frame_bitmap, 0xFFFFFFFF, bitmap_words);
 
-            // Align base up to page boundary
-            uint32_t start_frame = (base + PAGE_SIZE - 1) / PAGE_SIZE;
-            uint32_t end_frame = (base + length) / PAGE_SIZE;
+    // Second pass: mark available regions as free
+    for (multiboot_mmap_entry_t* mmap = mmap_start; (uint32_t)mmap < mmap_end; mmap = MMAP_NEXT(mmap)) {
+        uint32_t start_frame, end_frame;
+        if (mmap->type != MULTIBOOT_MEMORY_AVAILABLE || !mmap_entry_frames(mmap, &start_frame, &end_frame)) {
+            continue;
+        }
+
+        kprintf("Available: 0x%x - 0x%x (%u KB)\n", start_frame * PAGE_SIZE, end_frame * PAGE_SIZE - 1, (end_frame - start_frame) * 4);
+
+        // Skip first 1MB (BIOS, VGA, etc.) and kernel memory
+        uint32_t first_usable = (reserved_end > 0x100000 ? reserved_end : 0x100000) / PAGE_SIZE;
+        if (start_frame < first_usable) start_frame = first_usable;
+        if (end_frame > max_frame) end_frame = max_frame;
+        if (start_frame >= end_frame) continue;
 
-            // Mark frames as free (but skip low memory and kernel)
-            for (uint32_t frame = start_frame; frame < end_frame && frame < MAX_FRAMES; frame++) {
-                uint32_t addr = frame * PAGE_SIZE;
+        bitmap_clear_range(start_frame, end_frame - start_frame);
+        total_frames += end_frame - start_frame;
+    }
+
+    // Every frame the allocator doesn't manage gets flagged reserved, the rest start out free with no references
+    for (uint32_t f = 0; f < max_frame; f++) {
+        frame_descs[f].refcount = 0;
+        frame_descs[f].mapcount = 0;
+        frame_descs[f].flags = bitmap_test(f) ? PMM_FRAME_RESERVED : 0;
+    }
 
-                // Skip first 1MB (BIOS, VGA, etc.) and kernel memory
-                if (addr < 0x100000 || addr < kernel_end) {
-                    continue;
-                }
+    // Now build each zone's buddy free areas from every run of free frames in the bitmap
+    for (int z = 0; z < ZONE_COUNT; z++) {
+        zone_t* zone = &zones[z];
+        storage = buddy_setup(zone, storage);
 
-                bitmap_clear(frame);
-                total_frames++;
+        uint32_t frame = zone->start_frame;
+        while (frame < zone->end_frame) {
+            if (bitmap_test(frame)) {
+                frame++;
+                continue;
             }
+            uint32_t run_end = frame;
+            while (run_end < zone->end_frame && !bitmap_test(run_end)) {
+                run_end++;
+            }
+            buddy_add_range(zone, frame, run_end);
+            frame = run_end;
         }
 
-        // Move to next entry (size doesn't include the size field itself)
-        mmap = (multiboot_mmap_entry_t*)((uint32_t)mmap + mmap->size + sizeof(mmap->size));
+        if (zone->total_frames) {
+            kprintf("PMM: zone %s 0x%x - 0x%x, %u MB usable\n", zone->name, zone->start_frame * PAGE_SIZE, zone->end_frame * PAGE_SIZE - 1, zone->total_frames / 256);
+        }
     }
 
-    kprintf("PMM: %u frame (%u MB) available\n", total_frames, (total_frames * PAGE_SIZE) / (1024 * 1024));
+    kprintf("PMM: %u frame (%u MB) available\n", total_frames, total_frames / 256);
+    kprintf("PMM: bookkeeping for %u frames at 0x%x - 0x%x\n", max_frame, VIRT_TO_PHYS(frame_bitmap), early_next);
 }
 
-void* pmm_alloc_frame(void) {
-    int frame = bitmap_first_free();
-    if (frame < 0) {
-        kprintf("PMM: Out of memory!\n");
+// Buddy allocation proper, callers hold interrupts off (pmm_alloc_frames / pmm_free_frames do that)
+static void* buddy_alloc(zone_t* zone, uint32_t order) {
+    if (order > PMM_MAX_ORDER || zone->free_frames < (1u << order)) return NULL;
+
+    // smallest order that has a free block
+    uint32_t current = order;
+    int block = -1;
+    while (current <= PMM_MAX_ORDER) {
+        block = area_find(&zone->areas[current]);
+        if (block >= 0) break;
+        current++;
+    }
+    if (block < 0) {
         return NULL;
     }
 
-    bitmap_set(frame);
-    used_frames++;
+    area_clear(&zone->areas[current], block);
+
+    // split down to the requested order, keep the low half and free the high half each time
+    while (current > order) {
+        current--;
+        block <<= 1;
+        area_set(&zone->areas[current], block | 1);
+    }
+
+    uint32_t frame = zone->start_frame + ((uint32_t)block << order);
+    bitmap_set_range(frame, 1u << order);
+    // every frame of the block gets its own reference, so a run can be given back one frame at a time
+    for (uint32_t f = frame; f < frame + (1u << order); f++) {
+        frame_descs[f].refcount = 1;
+        frame_descs[f].mapcount = 0;
+    }
+    used_frames += 1u << order;
+    zone->free_frames -= 1u << order;
 
     return (void*)(frame * PAGE_SIZE);
 }
 
-void pmm_free_frame(void* frame_addr) {
-    uint32_t frame = (uint32_t)frame_addr / PAGE_SIZE;
+static void buddy_free(void* addr, uint32_t order) {
+    uint32_t frame = (uint32_t)addr / PAGE_SIZE;
+    uint32_t count = 1u << order;
 
-    if (frame >= MAX_FRAMES) {
+    if (order > PMM_MAX_ORDER || frame + count > max_frame) {
         return;
     }
+    zone_t* zone = zone_of(frame);
+    if (!zone || frame + count > zone->end_frame) {
+        return;
+    }
+    if (frame & (count - 1)) {
+        kprintf("PMM: free of 0x%x is not aligned to order %u\n", (uint32_t)addr, order);
+        return;
+    }
+
+    // every frame in the block must currently be allocated, otherwise this is a double free
+    // (or someone freeing memory they never got) and merging it would corrupt the free areas
+    for (uint32_t f = frame; f < frame + count; f++) {
+        if (!bitmap_test(f)) {
+            if (order > 0) {
+                kprintf("PMM: free of 0x%x (order %u) includes free frames\n", (uint32_t)addr, order);
+            }
+            return;
+        }
+    }
+
+    bitmap_clear_range(frame, count);
+    for (uint32_t f = frame; f < frame + count; f++) {
+        frame_descs[f].refcount = 0;
+        frame_descs[f].mapcount = 0;
+    }
+    used_frames -= count;
+    zone->free_frames += count;
+
+    // merge with the buddy for as long as the buddy is a whole free block of the same order
+    uint32_t block = (frame - zone->start_frame) >> order;
+    while (order < PMM_MAX_ORDER && area_test(&zone->areas[order], block ^ 1)) {
+        area_clear(&zone->areas[order], block ^ 1);
+        block >>= 1;
+        order++;
+    }
+    area_set(&zone->areas[order], block);
+}
+
+// Try the zone the flags ask for first, then fall back towards ZONE_DMA
+static void* zones_alloc(uint32_t order, uint32_t flags) {
+    int first = ZONE_NORMAL;
+    if (flags & PMM_ALLOC_DMA) {
+        first = ZONE_DMA;
+    } else if (flags & PMM_ALLOC_HIGH) {
+        first = ZONE_HIGH;
+    }
+
+    for (int z = first; z >= 0; z--) {
+        void* addr = buddy_alloc(&zones[z], order);
+        if (addr) return addr;
+    }
+    return NULL;
+}
+
+// Pre-zeroed frame pools
+// Zeroing a 4KB frame is pure overhead on the mapping path, so an idle-priority kernel thread zeroes frames ahead of time
+// (pmm_zero_pool_refill) and pmm_alloc_zeroed_frame just pops one. If the pool runs dry we zero synchronously like before.
+// There's one pool of direct-mapped frames (page tables and other kernel use) and one of high memory frames (user pages),
+// so user mappings don't eat into the direct-mapped zones just because those frames happened to be zeroed already.
+// Frames in a pool count as used, they're simply parked there until someone asks for a zeroed frame.
+#define ZERO_POOL_SIZE 64
+
+typedef struct {
+    uint32_t frames[ZERO_POOL_SIZE]; // physical addrs
+    uint32_t count;
+} zero_pool_t;
+
+enum { ZERO_POOL_KERNEL = 0, ZERO_POOL_HIGH, ZERO_POOL_COUNT };
+static zero_pool_t zero_pools[ZERO_POOL_COUNT];
+static uint32_t zero_pool_hits = 0; // zeroed frames handed out straight from a pool
+static uint32_t zero_pool_misses = 0; // ... and the ones that had to be zeroed on the spot
+
+// don't hoard pre-zeroed frames when memory is tight
+#define ZERO_POOL_MIN_FREE (4 * ZERO_POOL_SIZE)
+
+static void zero_frame(uint32_t phys) {
+    // high memory frames aren't in the direct map, kmap gives us a temporary window onto them
+    void* p = paging_kmap(phys);
+    memset32(p, 0, PAGE_SIZE / sizeof(uint32_t));
+    paging_kunmap(p);
+}
+
+static void* zero_pool_pop(int pool) {
+    uint32_t flags = irq_save();
+    void* frame = NULL;
+    if (zero_pools[pool].count > 0) {
+        frame = (void*)zero_pools[pool].frames[--zero_pools[pool].count];
+    }
+    irq_restore(flags);
+    return frame;
+}
+
+void* pmm_alloc_frames_flags(uint32_t order, uint32_t alloc_flags) {
+    uint32_t flags = irq_save();
+    void* addr = zones_alloc(order, alloc_flags);
+    irq_restore(flags);
+    return addr;
+}
+
+void* pmm_alloc_frames(uint32_t order) {
+    return pmm_alloc_frames_flags(order, PMM_ALLOC_KERNEL);
+}
+
+void pmm_free_frames(void* addr, uint32_t order) {
+    uint32_t flags = irq_save();
+    buddy_free(addr, order);
+    irq_restore(flags);
+}
+
+void* pmm_alloc_frame_flags(uint32_t alloc_flags) {
+    void* frame = pmm_alloc_frames_flags(0, alloc_flags);
+    if (!frame && !(alloc_flags & PMM_ALLOC_DMA)) {
+        // last resort, the zeroed pools are still perfectly good memory
+        if (alloc_flags & PMM_ALLOC_HIGH) {
+            frame = zero_pool_pop(ZERO_POOL_HIGH);
+        }
+        if (!frame) {
+            frame = zero_pool_pop(ZERO_POOL_KERNEL);
+        }
+    }
+    if (!frame) {
+        kprintf("PMM: Out of memory!\n");
+    }
+    return frame;
+}
+
+void* pmm_alloc_frame(void) {
+    return pmm_alloc_frame_flags(PMM_ALLOC_KERNEL);
+}
+
+void pmm_free_frame(void* frame_addr) {
+    pmm_free_frames(frame_addr, 0);
+}
+
+page_t* pmm_frame_desc(uint32_t phys) {
+    uint32_t frame = phys / PAGE_SIZE;
+    if (frame >= max_frame) return NULL;
+    return &frame_descs[frame];
+}
+
+void pmm_get_frame(uint32_t phys) {
+    page_t* page = pmm_frame_desc(phys);
+    if (!page || (page->flags & PMM_FRAME_RESERVED)) return;
+
+    uint32_t flags = irq_save();
+    if (page->refcount == 0) {
+        kprintf("PMM: reference taken on free frame 0x%x\n", phys & ~(PAGE_SIZE - 1));
+    } else if (page->refcount == 0xFFFF) {
+        kprintf("PMM: reference count overflow on frame 0x%x\n", phys & ~(PAGE_SIZE - 1));
+    } else {
+        page->refcount++;
+    }
+    irq_restore(flags);
+}
+
+int pmm_put_frame(uint32_t phys) {
+    page_t* page = pmm_frame_desc(phys);
+    if (!page || (page->flags & PMM_FRAME_RESERVED)) return 0;
+
+    uint32_t flags = irq_save();
+    int freed = 0;
+    if (page->refcount == 0) {
+        kprintf("PMM: reference dropped on free frame 0x%x\n", phys & ~(PAGE_SIZE - 1));
+    } else if (--page->refcount == 0) {
+        buddy_free((void*)(phys & ~(PAGE_SIZE - 1)), 0);
+        freed = 1;
+    }
+    irq_restore(flags);
+    return freed;
+}
+
+void* pmm_alloc_zeroed_frame(uint32_t alloc_flags) {
+    void* frame = NULL;
+
+    // DMA requests are rare enough that they just zero on the spot
+    if (!(alloc_flags & PMM_ALLOC_DMA)) {
+        if (alloc_flags & PMM_ALLOC_HIGH) {
+            frame = zero_pool_pop(ZERO_POOL_HIGH);
+        }
+        if (!frame) {
+            frame = zero_pool_pop(ZERO_POOL_KERNEL);
+        }
+        if (frame) {
+            zero_pool_hits++;
+            return frame;
+        }
+    }
+
+    // pool is empty (or the zeroing thread hasn't had any idle time yet), do it the slow way
+    zero_pool_misses++;
+    frame = pmm_alloc_frame_flags(alloc_flags);
+    if (frame) {
+        zero_frame((uint32_t)frame);
+    }
+    return frame;
+}
+
+int pmm_zero_pool_refill(void) {
+    // top up whichever pool is emptier, the high pool only if there is high memory at all
+    int pool = ZERO_POOL_KERNEL;
+    if (zones[ZONE_HIGH].free_frames >= ZERO_POOL_MIN_FREE && zero_pools[ZERO_POOL_HIGH].count < zero_pools[ZERO_POOL_KERNEL].count) {
+        pool = ZERO_POOL_HIGH;
+    }
+    zero_pool_t* zp = &zero_pools[pool];
+
+    if (zp->count >= ZERO_POOL_SIZE) return 0;
+
+    uint32_t zone_free = (pool == ZERO_POOL_HIGH) ? zones[ZONE_HIGH].free_frames : zones[ZONE_NORMAL].free_frames + zones[ZONE_DMA].free_frames;
+    if (zone_free < ZERO_POOL_MIN_FREE) return 0;
+
+    void* frame = pmm_alloc_frames_flags(0, pool == ZERO_POOL_HIGH ? PMM_ALLOC_HIGH : PMM_ALLOC_KERNEL);
+    if (!frame) return 0;
+
+    // the actual zeroing runs with interrupts on, that's the whole point of doing it in a preemptible thread
+    zero_frame((uint32_t)frame);
+
+    uint32_t flags = irq_save();
+    if (zp->count < ZERO_POOL_SIZE) {
+        zp->frames[zp->count++] = (uint32_t)frame;
+        frame = NULL;
+    }
+    irq_restore(flags);
 
-    if (bitmap_test(frame)) {
-        bitmap_clear(frame);
-        used_frames--;
+    // someone else filled the last slot while we were zeroing
+    if (frame) {
+        pmm_free_frames(frame, 0);
+        return 0;
     }
+    return 1;
+}
+
+uint32_t pmm_get_frame_limit(void) {
+    return max_frame;
+}
+
+// in KB, with the HIGH zone tracked there can be 4GB or more and bytes don't fit in 32 bits
+uint32_t pmm_get_zero_pool_frames(void) {
+    return zero_pools[ZERO_POOL_KERNEL].count + zero_pools[ZERO_POOL_HIGH].count;
 }
 
-uint32_t pmm_get_total_memory(void) {
-    return total_frames * PAGE_SIZE;
+uint32_t pmm_get_zero_pool_hits(void) {
+    return zero_pool_hits;
 }
 
-uint32_t pmm_get_free_memory(void) {
-    return (total_frames - used_frames) * PAGE_SIZE;
-}
\ No newline at end of file
+uint32_t pmm_get_zero_pool_misses(void) {
+    return zero_pool_misses;
+}
+
+uint32_t pmm_get_total_memory_kb(void) {
+    return total_frames * (PAGE_SIZE / 1024);
+}
+
+uint32_t pmm_get_free_memory_kb(void) {
+    return (total_frames - used_frames) * (PAGE_SIZE / 1024);
+}
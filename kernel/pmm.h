@@ -14,12 +14,19 @@
  * - Initialize physical memory bookkeeping using the Multiboot memory map
  * - Track total and free physical memory
  * - Allocate and free individual physical page frames
+ * - Allocate and free physically contiguous runs of 2^order frames (buddy system)
+ * - Split memory into zones (DMA / direct-mapped / high) and serve requests from
+ *   the zone their allocation flags call for
+ * - Keep a small descriptor per frame (reference count, map count, flags) so a
+ *   frame can be shared by several owners and is only freed by the last one
  *
  * Design notes:
  * - All addresses returned by the PMM are physical addresses.
  * - The PMM does not handle virtual addressing or paging; it is intended to
  *   serve as a low-level allocator for systems such as the VMM or kernel heap.
  * - PAGE_SIZE is fixed and must match the paging configuration of the system.
+ * - The frame bookkeeping is sized from the memory map at pmm_init() time and
+ *   placed directly after the kernel image, so all RAM below 4 GB is tracked.
 */
 
 
@@ -33,19 +40,80 @@
 // Page size in bytes
 #define PAGE_SIZE 4096
 
+// Largest block the buddy allocator hands out: 2^10 frames = 4MB
+#define PMM_MAX_ORDER 10
+
+// Allocation flags, they pick the zone a request is served from
+// a request that can't be satisfied from its zone falls back to the zones below it, never above
+#define PMM_ALLOC_KERNEL 0x00 // default: must be direct-mapped (PHYS_TO_VIRT works), page tables, heap pages, anything the kernel touches
+#define PMM_ALLOC_DMA 0x01 // must be below 16MB, for ISA DMA
+#define PMM_ALLOC_HIGH 0x02 // may come from high memory, the caller maps it itself (user pages)
+
+// Per-frame descriptor, one for every frame below the highest usable address, indexed by frame number
+// kept at 4 bytes so a 4GB machine pays 4MB for the whole array
+typedef struct {
+    uint16_t refcount; // owners of the frame, 0 = free. the frame goes back to the allocator when this drops to 0
+    uint8_t mapcount; // page table entries pointing at the frame (saturates, informational)
+    uint8_t flags; // PMM_FRAME_*
+} page_t;
+
+#define PMM_FRAME_RESERVED 0x01 // not managed by the allocator (holes, BIOS area, kernel image, PMM bookkeeping), get/put ignore it
+
 // init physical memory manager using multiboot memory map
 void pmm_init(multiboot_info_t* mbi);
 
 // allocate a single 4KB page frame, returns physical addr or NULL if out of memory
+// always direct-mapped, same as pmm_alloc_frame_flags(PMM_ALLOC_KERNEL)
 void* pmm_alloc_frame(void);
 
-// Free a previously allocated page frame
+// allocate a single frame from the zone the PMM_ALLOC_* flags ask for
+void* pmm_alloc_frame_flags(uint32_t flags);
+
+// Free a previously allocated page frame, no matter how many references it has
+// anything that might share the frame should use pmm_put_frame instead
 void pmm_free_frame(void* frame);
 
-// get total physical meory in bytes
-uint32_t pmm_get_total_memory(void);
+// allocate 2^order physically contiguous frames, aligned to their total size
+// returns physical addr of the first frame or NULL if no free run that big exists
+void* pmm_alloc_frames(uint32_t order);
+
+// same, from the zone the PMM_ALLOC_* flags ask for
+void* pmm_alloc_frames_flags(uint32_t order, uint32_t flags);
+
+// Free a run from pmm_alloc_frames, order must match the allocation
+// (frames of a run can also be freed one at a time with pmm_free_frame)
+void pmm_free_frames(void* addr, uint32_t order);
+
+// descriptor of the frame containing this physical address, NULL if it's beyond the memory the PMM tracks
+page_t* pmm_frame_desc(uint32_t phys);
+
+// take another reference on an allocated frame (a second mapping of it, a sharer, ...)
+void pmm_get_frame(uint32_t phys);
+
+// drop a reference, the frame is freed when the last one goes away
+// returns 1 if this freed the frame, 0 if someone else still holds it (or it's reserved)
+int pmm_put_frame(uint32_t phys);
+
+// allocate a frame that's already filled with zeroes (page tables, fresh anonymous memory)
+// served from the pre-zeroed pools when possible, falls back to zeroing on the spot
+void* pmm_alloc_zeroed_frame(uint32_t flags);
+
+// zero one free frame and park it in the pre-zeroed pool, called from the idle-priority zeroing thread
+// returns 1 if a frame was added, 0 if the pool is full or memory is too tight to hoard frames
+int pmm_zero_pool_refill(void);
+
+// pre-zeroed frames parked in the pools right now, and how many pmm_alloc_zeroed_frame calls were served from them vs zeroed on the spot
+uint32_t pmm_get_zero_pool_frames(void);
+uint32_t pmm_get_zero_pool_hits(void);
+uint32_t pmm_get_zero_pool_misses(void);
+
+// one past the highest frame the PMM tracks (frame numbers, so 4GB of RAM doesn't overflow)
+uint32_t pmm_get_frame_limit(void);
+
+// get total physical meory in KB (bytes would wrap at 4GB)
+uint32_t pmm_get_total_memory_kb(void);
 
-// get free physical memory in bytes
-uint32_t pmm_get_free_memory(void);
+// get free physical memory in KB
+uint32_t pmm_get_free_memory_kb(void);
 
 #endif
\ No newline at end of file
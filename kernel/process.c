@@ -1,21 +1,27 @@
 #include "process.h"
 #include "kheap.h"
+#include "slab.h"
+#include "string.h"
 #include "paging.h"
 #include "kprintf.h"
 #include "scheduler.h"
+#include "timer.h"
+#include "idt.h"
 
 //asm func
 extern void kthread_trampoline(void);
 
 // The process table
-// A flat array of PCBs, not pointers. Slots state with state = PROCESS_UNUSED are free.
+// A flat array of pointers to PCBs, NULL slots are free. The PCBs themselves come from their own object cache, a freed one stays
+// zeroed (its constructed state) on the cache's freelist so creating the next process is a pop instead of a trip through the heap
 // We can linearly to find free slots, this is O(n) but n is 64 so who cares
 
 // PIDsa are NOT the same as table indices. PIDs increment forever and never wrap.
 // A PID of 73 mihgt live in slot 2 if earlier processes exited and freed slots.
 // This matters because reusing PIDs would let a process accidentally signal/wait on the wrong target
 
-static process_t process_table[MAX_PROCESSES];
+static process_t* process_table[MAX_PROCESSES];
+static slab_cache_t* process_cache = NULL;
 
 // Monotonically increasing PID counter. PID 0 is reserved for the kernel.
 static uint32_t next_pid = 0;
@@ -24,15 +30,6 @@ static uint32_t next_pid = 0;
 // the scheduler updates this on every context switch
 static process_t* current_process = NULL;
 
-// Zero out a block of memory. We don't have libc's memset in freestanding mode, so we do it manually
-// If we add memset we can swap this out but that's cheating IMO
-static void zero_memory(void* dest, uint32_t size) {
-    uint8_t* d = (uint8_t*)dest;
-    for (uint32_t i = 0; i < size; i++) {
-        d[i] = 0;
-    }
-}
-
 // Copy a string into a fixed-size buffer, always null terminates
 // Like strncpy but without the annoying "doesn't null terminate" footgun
 
@@ -44,9 +41,28 @@ static void copy_name(char* dest, const char* src, uint32_t max_len) {
     dest[i] = '\0';
 }
 
+// constructed state of a PCB: all zero, which is also PROCESS_UNUSED. process_free puts it back like this
+static void process_ctor(void* obj) {
+    memset(obj, 0, sizeof(process_t));
+}
+
+// hand a PCB back to the cache and clear its table slot
+static void release_pcb(int slot) {
+    process_t* proc = process_table[slot];
+    memset(proc, 0, sizeof(process_t));
+    process_table[slot] = NULL;
+    cache_free(process_cache, proc);
+}
+
 void process_init(void) {
-    // clear the entire process table, all slots start as UNUSED
-    zero_memory(process_table, sizeof(process_table));
+    // clear the entire process table, all slots start out free
+    memset(process_table, 0, sizeof(process_table));
+
+    process_cache = cache_create("process", sizeof(process_t), 0, process_ctor);
+    if (!process_cache) {
+        kprintf("[PROCESS] Couldn't create the PCB cache!\n");
+        return;
+    }
 
     // set up PID 0: the kernel "process"
 
@@ -60,7 +76,12 @@ void process_init(void) {
 
     // kernel_esp is 0 for now. It gets filled in the first time the scheduler switches AWAY from PID 0, at which point the timer ISR's stack frame will be sitting on the boot stack, and we save that ESP
 
-    process_t* kernel_proc = &process_table[0];
+    process_t* kernel_proc = cache_alloc(process_cache);
+    if (!kernel_proc) {
+        kprintf("[PROCESS] Couldn't allocate PID 0's PCB!\n");
+        return;
+    }
+    process_table[0] = kernel_proc;
     kernel_proc->pid = 0;
     kernel_proc->state = PROCESS_RUNNING;
     copy_name(kernel_proc->name, "kernel", PROCESS_NAME_LEN);
@@ -83,7 +104,7 @@ process_t* process_alloc(void) {
     // linear scan for free slot
     int slot = -1;
     for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (process_table[i].state == PROCESS_UNUSED) {
+        if (!process_table[i]) {
             slot = i;
             break;
         }
@@ -94,10 +115,13 @@ process_t* process_alloc(void) {
         return NULL;
     }
 
-    process_t* proc = &process_table[slot];
-
-    // Zero the entire PCB so we start clean
-    zero_memory(proc, sizeof(process_t));
+    // comes out of the cache already zeroed
+    process_t* proc = cache_alloc(process_cache);
+    if (!proc) {
+        kprintf("[PROCESS] Out of memory for a PCB\n");
+        return NULL;
+    }
+    process_table[slot] = proc;
 
     // Assign a unique PID (monotonically increasing, never reused)
     proc->pid = next_pid++;
@@ -122,10 +146,10 @@ process_t* process_alloc(void) {
     //  low addr ------------------> high addr
     
     // as the process takes interrupts, kernel_esp moves left
-    proc->kernel_stack = (uint32_t)kmalloc_aligned(KERNEL_STACK_SIZE);
+    proc->kernel_stack = (uint32_t)kmalloc_aligned(KERNEL_STACK_SIZE, PAGE_SIZE);
     if (!proc->kernel_stack) {
         kprintf("[PROCESS] Failed to allocate kernel stack for PID %u\n", proc->pid);
-        proc->state = PROCESS_UNUSED;
+        release_pcb(slot);
         return NULL;
     }
 
@@ -148,7 +172,7 @@ void process_free(process_t* proc) {
     char name_copy[PROCESS_NAME_LEN];
     copy_name(name_copy, proc->name, PROCESS_NAME_LEN);
 
-    // Free the kernel stack (was allocated with kmalloc_aligned)
+    // Free the kernel stack (kmalloc_aligned blocks are normal heap blocks, kfree takes them)
     if (proc->kernel_stack) {
         kfree((void*)proc->kernel_stack);
     }
@@ -159,17 +183,21 @@ void process_free(process_t* proc) {
         vmm_destroy_address_space(proc->address_space);
     }
 
-    // Clear and mark the slot as free
-    zero_memory(proc, sizeof(process_t));
-    proc->state = PROCESS_UNUSED;
+    // Clear the PCB back to its constructed state and free the slot
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        if (process_table[i] == proc) {
+            release_pcb(i);
+            break;
+        }
+    }
 
     kprintf("[PROCESS] Freed PID %u (%s)\n", pid, name_copy);
 }
 
 process_t* process_get(uint32_t pid) {
     for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (process_table[i].state != PROCESS_UNUSED && process_table[i].pid == pid) {
-            return &process_table[i];
+        if (process_table[i] && process_table[i]->pid == pid) {
+            return process_table[i];
         }
     }
     return NULL;
@@ -181,8 +209,7 @@ process_t* process_current(void) {
 
 process_t* process_get_by_slot(int slot) {
     if (slot < 0 || slot >= MAX_PROCESSES) return NULL;
-    if (process_table[slot].state == PROCESS_UNUSED) return NULL;
-    return &process_table[slot];
+    return process_table[slot];
 }
 
 void process_set_current(process_t* proc) {
@@ -205,6 +232,26 @@ void kthread_exit(void) {
     while (1) { __asm__ volatile("hlt"); }
 }
 
+void kthread_sleep(uint32_t ticks) {
+    // same as kthread_exit, we're changing our own state and calling schedule() directly
+    uint32_t flags = irq_save();
+
+    process_t* proc = process_current();
+    if (proc && ticks) {
+        proc->wake_tick = timer_get_ticks() + ticks;
+        if (proc->wake_tick == 0) proc->wake_tick = 1; // 0 means not sleeping
+        proc->state = PROCESS_BLOCKED;
+
+        // schedule() leaves us on the CPU if nobody else can run, then we just wait for the timer tick that wakes us
+        while (proc->state == PROCESS_BLOCKED) {
+            schedule();
+            if (proc->state == PROCESS_BLOCKED) __asm__ volatile("sti; hlt; cli");
+        }
+    }
+
+    irq_restore(flags);
+}
+
 // create a kernel thread
 
 // allocates a PCB and kernel stack, then sets up the stack so taht when context_switch() switches to this thread for the first time, it "returns" into kthread_trampoline, which enables interrupts and calls the entry function
@@ -13,9 +13,14 @@
 #define PROCESS_NAME_LEN 32
 #define KERNEL_STACK_SIZE 8192 // 8KB per process kernel stack
 
+// priority values (0 = highest)
+// idle class processes only get the CPU when nothing else is READY, this is for work that should soak up time the CPU would otherwise spend in hlt
+#define PROCESS_PRIORITY_NORMAL 0
+#define PROCESS_PRIORITY_IDLE 255
+
 // process lifecycle states
 typedef enum {
-    PROCESS_UNUSED = 0, // PCB slot is available in the process table
+    PROCESS_UNUSED = 0, // PCB is free (sitting zeroed in the PCB cache)
     PROCESS_READY, // runnable, waiting in the ready queue for the scheduler to pick it up
     PROCESS_RUNNING, // currently executing on the CPU (only one at a time on uniprocessor)
     PROCESS_BLOCKED, // waiting on something; I/O, sleep, semaphone, etc.
@@ -55,8 +60,7 @@ typedef struct {
 
 // The PCB itself
 // One of these exists for every active process in the system
-// The process table is a flat array of these, not pointers to heap allocated structs
-// This avoids chicken and egg issues with the heap and keeps things cache friendly
+// PCBs come from their own slab cache (not the heap), the process table holds pointers to them
 typedef struct {
     uint32_t pid; // unique, monotonically increasing, never reused
     process_state_t state; // curr lifecycle state
@@ -71,6 +75,7 @@ typedef struct {
     uint32_t kernel_esp; // saved kernel ESP; THIS is the context switch pivot point
 
     uint32_t priority; // for future scheduling (0 = highest)
+    uint32_t wake_tick; // BLOCKED in kthread_sleep until timer_get_ticks() gets here (0 = not sleeping)
     uint32_t parent_pid; // who spwaned this process
     int32_t exit_code; // set on exit, read by parent via waitpid
 } process_t; 
@@ -78,14 +83,14 @@ typedef struct {
 // init process subsystem, sets up PID 0 for the kernel
 void process_init(void);
 
-// Allocate a new PCB from the process table. Returns NULL if table is full
+// Allocate a new PCB and a process table slot for it. Returns NULL if table is full
 // Assigns a PID, allocates a kernel stack, sets state to READY
 process_t* process_alloc(void);
 
-// Free a PCB slot. Releases kernel stack, destroys address space, marks slot UNUSED
+// Free a PCB. Releases kernel stack, destroys address space, gives the PCB back to its cache and frees the slot
 void process_free(process_t* proc);
 
-// Look up a process by PID. Returns NULL if not found or slot is UNUSED
+// Look up a process by PID. Returns NULL if not found
 process_t* process_get(uint32_t pid);
 
 // get the currently running process (the one whose kernel stack we're on)
@@ -104,4 +109,7 @@ process_t* kthread_create(void (*entry)(void), const char* name);
 // Marks process as ZOMBIE and yields to scheduler
 void kthread_exit(void);
 
+// Blocks the current thread for at least ticks timer ticks, the CPU goes to whoever else is READY (idle class included) meanwhile
+void kthread_sleep(uint32_t ticks);
+
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "process.h"
 #include "vmm.h"
 #include "kprintf.h"
+#include "timer.h"
 
 // asm function
 extern void context_switch(uint32_t* old_esp_ptr, uint32_t new_esp);
@@ -14,12 +15,39 @@ void scheduler_init(void) {
     kprintf("[SCHEDULER] Round Robin scheduler initialized\n");
 }
 
+// next READY process after current_slot in round robin order, either from the normal or the idle class
+static int find_next_ready(int current_slot, int idle_class) {
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        int slot = (current_slot + i) % MAX_PROCESSES;
+        process_t* proc = process_get_by_slot(slot);
+        if (proc && proc->state == PROCESS_READY && (proc->priority >= PROCESS_PRIORITY_IDLE) == idle_class) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// make sleepers whose wake tick has come (kthread_sleep) runnable again. the current process can be one of them when it was
+// waiting in kthread_sleep's hlt, it just keeps running
+static void wake_sleepers(process_t* current) {
+    uint32_t now = timer_get_ticks();
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        process_t* proc = process_get_by_slot(i);
+        if (proc && proc->state == PROCESS_BLOCKED && proc->wake_tick && (int32_t)(now - proc->wake_tick) >= 0) {
+            proc->wake_tick = 0;
+            proc->state = proc == current ? PROCESS_RUNNING : PROCESS_READY;
+        }
+    }
+}
+
 void schedule(void) {
     if (!scheduler_enabled) return;
 
     process_t* current = process_current();
     if (!current) return;
 
+    wake_sleepers(current);
+
     int current_slot = -1;
     for (int i = 0; i < MAX_PROCESSES; i++) {
         if (process_get_by_slot(i) == current) {
@@ -29,14 +57,12 @@ void schedule(void) {
     }
     if (current_slot == -1) return; // ideally shouldn't happen
 
-    int next_slot = -1;
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        int slot = (current_slot + i) % MAX_PROCESSES;
-        process_t* proc = process_get_by_slot(slot);
-        if (proc && proc->state == PROCESS_READY) {
-            next_slot = slot;
-            break;
-        }
+    // normal processes always go first. idle class ones (PID 0's hlt loop once boot is done, the page zeroing thread)
+    // only run when there's nothing else, and a normal process that's still running isn't preempted for them
+    int next_slot = find_next_ready(current_slot, 0);
+    if (next_slot == -1) {
+        if (current->state == PROCESS_RUNNING && current->priority < PROCESS_PRIORITY_IDLE) return;
+        next_slot = find_next_ready(current_slot, 1);
     }
 
     // nothing else to run, curr process keeps the CPU
@@ -1,6 +1,11 @@
 #include "shell.h"
 #include "terminal.h"
 #include "timer.h"
+#include "vmm.h"
+#include "paging.h"
+#include "pmm.h"
+#include "kheap.h"
+#include "string.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -47,6 +52,11 @@ static void cmd_help(void) {
     terminal_writestring("clear - Clear the screen\n");
     terminal_writestring("ticks - Show number of timer ticks since boot\n");
     terminal_writestring("about - About TupleOS\n");
+    terminal_writestring("tlbbench - Time address space switches with and without global kernel pages\n");
+    terminal_writestring("heap - Show kernel heap usage and the pre-zeroed frame pool\n");
+    terminal_writestring("membench - Time page-sized zero/copy with byte loops vs memset/memcpy\n");
+    terminal_writestring("lazymap - Time mapping a big region eagerly vs demand paged\n");
+    terminal_writestring("cow - Clone an address space copy-on-write and check a write only hits the clone\n");
 }
 
 static void cmd_clear(void) {
@@ -65,6 +75,237 @@ static void cmd_ticks(void) {
     terminal_putchar('\n');
 }
 
+// TLB benchmark: bounce between two address spaces and touch a 2MB vmalloc buffer (4KB pages, one TLB entry each) after every switch
+// that's well past the first level data TLB but still fits the second level one, roughly what a kernel path touches across a switch
+// with global kernel pages those stay in the TLB, the "flushed" run throws them away each time like a CPU without PGE would
+#define TLB_BENCH_ROUNDS 1000
+#define TLB_BENCH_PAGES 512
+
+static inline uint32_t rdtsc_low(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo;
+}
+
+static uint32_t tlb_bench_run(vmm_address_space_t* a, vmm_address_space_t* b, uint8_t* buf, int flush_all) {
+    volatile uint32_t sink = 0;
+    uint32_t start = rdtsc_low();
+    for (int r = 0; r < TLB_BENCH_ROUNDS; r++) {
+        vmm_switch_address_space((r & 1) ? a : b);
+        if (flush_all) paging_flush_tlb_all();
+        for (int p = 0; p < TLB_BENCH_PAGES; p++) {
+            sink += *(volatile uint32_t*)(buf + p * PAGE_SIZE);
+        }
+    }
+    (void)sink;
+    return (rdtsc_low() - start) / TLB_BENCH_ROUNDS;
+}
+
+static void cmd_tlbbench(void) {
+    vmm_address_space_t* home = vmm_get_current_space();
+    vmm_address_space_t* other = vmm_create_address_space();
+    uint8_t* buf = vmalloc(TLB_BENCH_PAGES * PAGE_SIZE);
+    if (!other || !buf) {
+        terminal_writestring("tlbbench: out of memory\n");
+        if (other) vmm_destroy_address_space(other);
+        vfree(buf);
+        return;
+    }
+
+    uint32_t global = tlb_bench_run(home, other, buf, 0);
+    uint32_t flushed = tlb_bench_run(home, other, buf, 1);
+    vmm_switch_address_space(home);
+    vmm_destroy_address_space(other);
+    vfree(buf);
+
+    terminal_writestring("cycles per switch + ");
+    print_uint(TLB_BENCH_PAGES);
+    terminal_writestring(" kernel page touches\n  global kernel pages: ");
+    print_uint(global);
+    terminal_writestring("\n  full flush:          ");
+    print_uint(flushed);
+    terminal_putchar('\n');
+}
+
+// memset/memcpy benchmark: one page zeroed and copied MEM_BENCH_ROUNDS times with the byte loops the kernel used to have,
+// then with string.c. The loops are kept from being turned into memset/memcpy calls so they really are byte at a time
+#define MEM_BENCH_ROUNDS 1000
+
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void byte_zero(uint8_t* d, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) d[i] = 0;
+}
+
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void byte_copy(uint8_t* d, const uint8_t* s, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) d[i] = s[i];
+}
+
+static void mem_bench_line(const char* what, uint32_t loop, uint32_t fast) {
+    terminal_writestring(what);
+    print_uint(loop);
+    terminal_writestring(" -> ");
+    print_uint(fast);
+    terminal_writestring(" cycles/page (");
+    print_uint(fast ? loop / fast : 0);
+    terminal_writestring("x)\n");
+}
+
+static void cmd_membench(void) {
+    uint8_t* a = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+    uint8_t* b = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+    if (!a || !b) {
+        terminal_writestring("membench: out of memory\n");
+        kfree(a);
+        kfree(b);
+        return;
+    }
+
+    uint32_t start = rdtsc_low();
+    for (int r = 0; r < MEM_BENCH_ROUNDS; r++) byte_zero(a, PAGE_SIZE);
+    uint32_t zero_loop = (rdtsc_low() - start) / MEM_BENCH_ROUNDS;
+
+    start = rdtsc_low();
+    for (int r = 0; r < MEM_BENCH_ROUNDS; r++) memset(a, 0, PAGE_SIZE);
+    uint32_t zero_fast = (rdtsc_low() - start) / MEM_BENCH_ROUNDS;
+
+    start = rdtsc_low();
+    for (int r = 0; r < MEM_BENCH_ROUNDS; r++) byte_copy(b, a, PAGE_SIZE);
+    uint32_t copy_loop = (rdtsc_low() - start) / MEM_BENCH_ROUNDS;
+
+    start = rdtsc_low();
+    for (int r = 0; r < MEM_BENCH_ROUNDS; r++) memcpy(b, a, PAGE_SIZE);
+    uint32_t copy_fast = (rdtsc_low() - start) / MEM_BENCH_ROUNDS;
+
+    kfree(a);
+    kfree(b);
+
+    mem_bench_line("zero: ", zero_loop, zero_fast);
+    mem_bench_line("copy: ", copy_loop, copy_fast);
+}
+
+// demand paging: map a LAZY_BENCH_SIZE region in a scratch address space both ways and touch a few pages of it
+// eager pays for every frame at map time, lazy pays one page fault per page actually touched
+#define LAZY_BENCH_SIZE (16 * 1024 * 1024)
+#define LAZY_BENCH_TOUCH 16
+#define LAZY_BENCH_BASE 0x00400000
+
+static uint32_t lazy_bench_run(vmm_address_space_t* space, uint32_t flags, uint32_t* touch_cycles) {
+    uint32_t start = rdtsc_low();
+    if (vmm_map_region(space, LAZY_BENCH_BASE, LAZY_BENCH_SIZE, flags, REGION_USER_DATA) < 0) return 0;
+    uint32_t map_cycles = rdtsc_low() - start;
+
+    start = rdtsc_low();
+    for (int p = 0; p < LAZY_BENCH_TOUCH; p++) {
+        *(volatile uint32_t*)(LAZY_BENCH_BASE + p * (LAZY_BENCH_SIZE / LAZY_BENCH_TOUCH)) = p;
+    }
+    *touch_cycles = rdtsc_low() - start;
+
+    vmm_unmap_region(space, LAZY_BENCH_BASE);
+    return map_cycles;
+}
+
+static void cmd_lazymap(void) {
+    vmm_address_space_t* home = vmm_get_current_space();
+    vmm_address_space_t* scratch = vmm_create_address_space();
+    if (!scratch) {
+        terminal_writestring("lazymap: couldn't create an address space\n");
+        return;
+    }
+
+    // the region is in the user half, so it's only reachable while the scratch space is loaded
+    vmm_switch_address_space(scratch);
+    uint32_t eager_touch = 0, lazy_touch = 0;
+    uint32_t eager = lazy_bench_run(scratch, VMM_READ | VMM_WRITE | VMM_USER, &eager_touch);
+    uint32_t lazy = lazy_bench_run(scratch, VMM_READ | VMM_WRITE | VMM_USER | VMM_LAZY, &lazy_touch);
+    vmm_switch_address_space(home);
+    vmm_destroy_address_space(scratch);
+
+    terminal_writestring("cycles to map ");
+    print_uint(LAZY_BENCH_SIZE / (1024 * 1024));
+    terminal_writestring(" MB, then touch ");
+    print_uint(LAZY_BENCH_TOUCH);
+    terminal_writestring(" pages\n  eager: ");
+    print_uint(eager);
+    terminal_writestring(" + ");
+    print_uint(eager_touch);
+    terminal_writestring("\n  lazy:  ");
+    print_uint(lazy);
+    terminal_writestring(" + ");
+    print_uint(lazy_touch);
+    terminal_putchar('\n');
+}
+
+// copy-on-write: a template space with COW_TEMPLATE_SIZE of data, cloned once. the clone writes to one page, which must not show
+// through to the template, and only that page should cost a frame
+#define COW_TEMPLATE_SIZE (4 * 1024 * 1024)
+
+static void cmd_cow(void) {
+    vmm_address_space_t* home = vmm_get_current_space();
+    vmm_address_space_t* template = vmm_create_address_space();
+    if (!template || vmm_map_region(template, LAZY_BENCH_BASE, COW_TEMPLATE_SIZE, VMM_READ | VMM_WRITE | VMM_USER, REGION_USER_DATA) < 0) {
+        terminal_writestring("cow: couldn't set up the template\n");
+        if (template) vmm_destroy_address_space(template);
+        return;
+    }
+    vmm_switch_address_space(template);
+    volatile uint32_t* word = (volatile uint32_t*)LAZY_BENCH_BASE;
+    *word = 1;
+
+    uint32_t free_before = pmm_get_free_memory_kb();
+    uint32_t start = rdtsc_low();
+    vmm_address_space_t* clone = vmm_clone_address_space(template);
+    uint32_t clone_cycles = rdtsc_low() - start;
+    if (!clone) {
+        vmm_switch_address_space(home);
+        vmm_destroy_address_space(template);
+        terminal_writestring("cow: clone failed\n");
+        return;
+    }
+    uint32_t clone_cost = free_before - pmm_get_free_memory_kb(); // KB
+
+    vmm_switch_address_space(clone);
+    start = rdtsc_low();
+    *word = 2; // faults, the clone gets its own copy of the page
+    uint32_t fault_cycles = rdtsc_low() - start;
+    vmm_switch_address_space(template);
+    uint32_t seen = *word;
+
+    vmm_switch_address_space(home);
+    vmm_destroy_address_space(clone);
+    vmm_destroy_address_space(template);
+
+    terminal_writestring("clone of ");
+    print_uint(COW_TEMPLATE_SIZE / 1024);
+    terminal_writestring(" KB: ");
+    print_uint(clone_cycles);
+    terminal_writestring(" cycles, ");
+    print_uint(clone_cost);
+    terminal_writestring(" KB of frames\nfirst write in the clone: ");
+    print_uint(fault_cycles);
+    terminal_writestring(" cycles, template ");
+    terminal_writestring(seen == 1 ? "unchanged (ok)\n" : "CHANGED (broken)\n");
+}
+
+static void cmd_heap(void) {
+    terminal_writestring("Heap used: ");
+    print_uint(kheap_get_used() / 1024);
+    terminal_writestring(" KB, free: ");
+    print_uint(kheap_get_free() / 1024);
+    terminal_writestring(" KB, trimmed back to PMM: ");
+    print_uint(kheap_get_reclaimed() / 1024);
+    terminal_writestring(" KB\n");
+
+    // if the idle-time zeroer is getting CPU, the pool is full and most zeroed allocations are hits
+    terminal_writestring("Pre-zeroed frames: ");
+    print_uint(pmm_get_zero_pool_frames());
+    terminal_writestring(" pooled, ");
+    print_uint(pmm_get_zero_pool_hits());
+    terminal_writestring(" allocs served from the pool, ");
+    print_uint(pmm_get_zero_pool_misses());
+    terminal_writestring(" zeroed on the spot\n");
+}
+
 void shell_init(void){
     terminal_writestring("Welcome To The TupleOS Shell\n");
     terminal_writestring("Type 'help' for a list of commands\n");
@@ -83,6 +324,11 @@ static const command_t commands[] = {
     { "clear", cmd_clear },
     { "about", cmd_about },
     { "ticks", cmd_ticks },
+    { "tlbbench", cmd_tlbbench },
+    { "heap", cmd_heap },
+    { "membench", cmd_membench },
+    { "lazymap", cmd_lazymap },
+    { "cow", cmd_cow },
 };
 
 static void shell_execute(void) {
@@ -0,0 +1,193 @@
+#include "slab.h"
+#include "pmm.h"
+#include "paging.h"
+#include "kprintf.h"
+#include "idt.h"
+
+// the header is rounded up so the first slot is 8-byte aligned like everything kmalloc hands out
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + 7) & ~7u)
+
+static void* slot_at(slab_t* slab, uint32_t index) {
+    return (uint8_t*)slab + slab->cache->first_slot + index * slab->cache->object_size;
+}
+
+// the freelist link of a free slot
+static void** link_of(slab_cache_t* cache, void* obj) {
+    return (void**)((uint8_t*)obj + cache->link_offset);
+}
+
+static void partial_push(slab_cache_t* cache, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial) cache->partial->prev = slab;
+    cache->partial = slab;
+}
+
+static void partial_remove(slab_cache_t* cache, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+static void cache_setup(slab_cache_t* cache, const char* name, uint32_t object_size, uint32_t align, void (*ctor)(void*)) {
+    if (align < 8) align = 8;
+
+    // slots have to hold the freelist link and keep 8-byte alignment
+    if (object_size < sizeof(void*)) object_size = sizeof(void*);
+    object_size = (object_size + 7) & ~7u;
+
+    // a constructed object has to survive sitting on the freelist, so the link goes right after it instead of over its first word
+    cache->link_offset = 0;
+    if (ctor) {
+        cache->link_offset = object_size;
+        object_size += 8; // the link, keeping the 8-byte rounding
+    }
+    object_size = (object_size + align - 1) & ~(align - 1);
+
+    cache->name = name;
+    cache->object_size = object_size;
+    cache->align = align;
+    cache->first_slot = (SLAB_HEADER_SIZE + align - 1) & ~(align - 1);
+    cache->ctor = ctor;
+    cache->capacity = cache->first_slot < SLAB_SIZE ? (SLAB_SIZE - cache->first_slot) / object_size : 0;
+    cache->partial = NULL;
+    cache->empty = NULL;
+    cache->slabs = 0;
+    cache->in_use = 0;
+}
+
+void slab_cache_init(slab_cache_t* cache, const char* name, uint32_t object_size) {
+    cache_setup(cache, name, object_size, 8, NULL);
+}
+
+static slab_t* slab_create(slab_cache_t* cache) {
+    // the buddy allocator hands out blocks aligned to their size, that's what lets slab_free find the header by masking
+    void* phys = pmm_alloc_frames(SLAB_ORDER);
+    if (!phys) return NULL;
+
+    slab_t* slab = (slab_t*)PHYS_TO_VIRT(phys);
+    slab->cache = cache;
+    slab->next = slab->prev = NULL;
+    slab->free = NULL;
+    slab->fresh = 0;
+    slab->in_use = 0;
+    cache->slabs++;
+    return slab;
+}
+
+void* slab_alloc(slab_cache_t* cache) {
+    // interrupt handlers allocate from the same caches
+    uint32_t flags = irq_save();
+    slab_t* slab = cache->partial;
+    if (!slab) {
+        // no room anywhere, use the spare empty slab or get a new one
+        slab = cache->empty;
+        if (slab) {
+            cache->empty = NULL;
+        } else {
+            slab = slab_create(cache);
+            if (!slab) {
+                irq_restore(flags);
+                return NULL;
+            }
+        }
+        partial_push(cache, slab);
+    }
+
+    void* obj;
+    if (slab->free) {
+        obj = slab->free;
+        slab->free = *link_of(cache, obj);
+    } else {
+        obj = slot_at(slab, slab->fresh++);
+        if (cache->ctor) cache->ctor(obj);
+    }
+    slab->in_use++;
+    cache->in_use++;
+
+    if (slab->in_use == cache->capacity) {
+        partial_remove(cache, slab); // full slabs aren't on any list, slab_free puts them back
+    }
+    irq_restore(flags);
+    return obj;
+}
+
+void slab_free(void* ptr) {
+    slab_t* slab = (slab_t*)((uint32_t)ptr & ~(uint32_t)(SLAB_SIZE - 1));
+    slab_cache_t* cache = slab->cache;
+
+    uint32_t flags = irq_save();
+    if (slab->in_use == 0) {
+        irq_restore(flags);
+        kprintf("Slab: free of 0x%x in empty %s slab (double free?)\n", (uint32_t)ptr, cache->name);
+        return;
+    }
+
+    *link_of(cache, ptr) = slab->free;
+    slab->free = ptr;
+    if (slab->in_use-- == cache->capacity) {
+        partial_push(cache, slab); // was full, has room again
+    }
+    cache->in_use--;
+
+    if (slab->in_use == 0) {
+        // keep one empty slab per cache, anything beyond that goes back to the PMM
+        // its freelist stays as it is, for a cache with a ctor those slots are still constructed
+        partial_remove(cache, slab);
+        if (!cache->empty) {
+            cache->empty = slab;
+        } else {
+            cache->slabs--;
+            pmm_free_frames((void*)VIRT_TO_PHYS(slab), SLAB_ORDER);
+        }
+    }
+    irq_restore(flags);
+}
+
+int slab_owns(void* ptr) {
+    uint32_t addr = (uint32_t)ptr;
+    return addr >= KERNEL_VIRTUAL_BASE && addr < PHYS_TO_VIRT(paging_get_direct_map_end());
+}
+
+// the caches made by cache_create come out of a cache of their own
+static slab_cache_t cache_cache;
+static int cache_cache_ready = 0;
+
+slab_cache_t* cache_create(const char* name, uint32_t size, uint32_t align, void (*ctor)(void*)) {
+    if (align & (align - 1)) return NULL;
+
+    if (!cache_cache_ready) {
+        slab_cache_init(&cache_cache, "slab_cache", sizeof(slab_cache_t));
+        cache_cache_ready = 1;
+    }
+
+    slab_cache_t* cache = slab_alloc(&cache_cache);
+    if (!cache) return NULL;
+
+    cache_setup(cache, name, size, align, ctor);
+    if (cache->capacity == 0) {
+        kprintf("Slab: %s objects (%u bytes, align %u) don't fit in a slab\n", name, size, align);
+        slab_free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void* cache_alloc(slab_cache_t* cache) {
+    return slab_alloc(cache);
+}
+
+void cache_free(slab_cache_t* cache, void* obj) {
+    if (!obj) return;
+
+    slab_t* slab = (slab_t*)((uint32_t)obj & ~(uint32_t)(SLAB_SIZE - 1));
+    if (slab->cache != cache) {
+        kprintf("Slab: 0x%x freed to %s but belongs to %s\n", (uint32_t)obj, cache->name, slab->cache->name);
+        return;
+    }
+    slab_free(obj);
+}
@@ -0,0 +1,73 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+* Slab allocator
+* The kheap's first-fit list walks every block on every kmalloc, so the more fragmented the heap gets the slower a 16 byte allocation
+* becomes. Most kernel allocations are small and come in a handful of sizes though, so we keep a cache per size and carve each cache's
+* objects out of slabs: 16KB chunks of physical memory (order-2 buddy blocks, reached through the direct map) cut into equal slots.
+*
+* Every slab keeps its free slots on a freelist threaded through the free slots themselves, and every cache keeps its slabs that still
+* have room on a list, so alloc and free are both a couple of pointer swaps. A slab's header sits at the start of its 16KB, and slabs are
+* aligned to their size, so any object pointer finds its slab by masking off the low bits.
+*/
+
+#define SLAB_ORDER 2 // slabs are 2^SLAB_ORDER frames
+#define SLAB_SIZE (4096 << SLAB_ORDER)
+
+struct slab_cache;
+
+// header at the start of every slab
+typedef struct slab {
+    struct slab_cache* cache; // the cache this slab belongs to
+    struct slab* next; // cache's partial list (slabs with at least one free slot)
+    struct slab* prev;
+    void* free; // freelist of slots that were handed out and given back
+    uint32_t fresh; // slots from here on were never handed out, they're used before the freelist grows
+    uint32_t in_use; // slots currently handed out
+} slab_t;
+
+typedef struct slab_cache {
+    const char* name;
+    uint32_t object_size; // slot size, a multiple of 8 and of align
+    uint32_t align; // every slot starts on a multiple of this
+    uint32_t first_slot; // offset of slot 0 from the start of the slab, the header rounded up to align
+    uint32_t link_offset; // where a free slot keeps its freelist link
+    void (*ctor)(void*); // run once on each slot the first time it's handed out, NULL if the cache has none
+    uint32_t capacity; // slots per slab
+    slab_t* partial; // slabs with free slots, the head is where allocations come from
+    slab_t* empty; // one completely free slab kept around so a cache going back and forth around a slab boundary doesn't hit the PMM every time
+    uint32_t slabs; // slabs owned, including the empty one
+    uint32_t in_use; // objects handed out across all slabs
+} slab_cache_t;
+
+// set up a cache for objects of object_size bytes, no memory is taken until the first slab_alloc
+void slab_cache_init(slab_cache_t* cache, const char* name, uint32_t object_size);
+
+// returns NULL if a new slab was needed and the PMM couldn't provide one
+void* slab_alloc(slab_cache_t* cache);
+
+// give an object back to whatever cache it came from
+void slab_free(void* ptr);
+
+// does this pointer belong to a slab (i.e. the direct map rather than the heap)
+int slab_owns(void* ptr);
+
+// Object caches
+// For kernel objects that get created and destroyed over and over (PCBs, VMM regions, address spaces) each type gets its own cache,
+// so the churn never touches the general heap. A cache with a constructor hands out objects that are already initialised: the ctor
+// runs once per slot, and cache_free expects the object back in that constructed state, so a recycled object skips it entirely.
+// That's why such caches keep the freelist link after the object instead of on top of it
+// align has to be a power of two (0 = the default 8). NULL if the cache couldn't be set up
+slab_cache_t* cache_create(const char* name, uint32_t size, uint32_t align, void (*ctor)(void*));
+
+// NULL if the cache needed a new slab and the PMM is out of memory
+void* cache_alloc(slab_cache_t* cache);
+
+// obj has to come from this cache, and be back in its constructed state if the cache has a ctor
+void cache_free(slab_cache_t* cache, void* obj);
+
+#endif
@@ -0,0 +1,72 @@
+#include "string.h"
+
+// The string instructions take their count in ECX, the destination in EDI and the source in ESI, and advance both pointers as
+// they go (forwards, the direction flag is always clear in C code). The "+" constraints tell GCC all three get changed
+
+void* memset(void* dest, int value, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    uint32_t fill = (uint8_t)value * 0x01010101u; // the byte in all four lanes, for stosd
+
+    // bytes until d is 4-byte aligned, then whole dwords, then the leftover bytes
+    size_t head = (0u - (uint32_t)d) & 3;
+    if (head > n) head = n;
+    size_t words = (n - head) / 4;
+    size_t tail = (n - head) & 3;
+
+    __asm__ volatile("rep stosb" : "+D"(d), "+c"(head) : "a"(fill) : "memory");
+    __asm__ volatile("rep stosl" : "+D"(d), "+c"(words) : "a"(fill) : "memory");
+    __asm__ volatile("rep stosb" : "+D"(d), "+c"(tail) : "a"(fill) : "memory");
+    return dest;
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+
+    // align the destination, the source ends up wherever it ends up (usually aligned too for the things we copy)
+    size_t head = (0u - (uint32_t)d) & 3;
+    if (head > n) head = n;
+    size_t words = (n - head) / 4;
+    size_t tail = (n - head) & 3;
+
+    __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(head) : : "memory");
+    __asm__ volatile("rep movsl" : "+D"(d), "+S"(s), "+c"(words) : : "memory");
+    __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(tail) : : "memory");
+    return dest;
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+
+    // a forward copy is only a problem when dest starts inside src, everything else is a plain memcpy
+    if (d <= s || d >= s + n) {
+        return memcpy(dest, src, n);
+    }
+
+    // copy backwards: set the direction flag so the string instructions walk down, do the odd bytes at the end first,
+    // then step the pointers back to the start of the last whole dword and do the rest 4 at a time
+    // (isr_common clears the flag on entry, so an interrupt landing in here doesn't run C code with it set)
+    uint8_t* d_last = d + n - 1;
+    const uint8_t* s_last = s + n - 1;
+    size_t tail = n & 3;
+    size_t words = n / 4;
+    __asm__ volatile(
+        "std\n\t"
+        "rep movsb\n\t"
+        "sub $3, %%edi\n\t"
+        "sub $3, %%esi\n\t"
+        "mov %3, %%ecx\n\t"
+        "rep movsl\n\t"
+        "cld"
+        : "+D"(d_last), "+S"(s_last), "+c"(tail)
+        : "r"(words)
+        : "memory");
+    return dest;
+}
+
+void* memset32(void* dest, uint32_t value, size_t count) {
+    uint32_t* d = (uint32_t*)dest;
+    __asm__ volatile("rep stosl" : "+D"(d), "+c"(count) : "a"(value) : "memory");
+    return dest;
+}
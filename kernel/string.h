@@ -0,0 +1,27 @@
+#ifndef STRING_H
+#define STRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+* Kernel string library
+* No libc in freestanding mode, so these are ours. Same names and signatures as the standard ones, which also matters because GCC
+* is allowed to emit calls to memset/memcpy/memmove on its own (big struct copies and such) even with -ffreestanding
+*
+* The bulk of every operation is a rep stosd / rep movsd, 4 bytes per iteration instead of 1. The destination gets byte-aligned to
+* a 4 byte boundary first (misaligned dword stores are slower) and whatever is left over at the end goes a byte at a time
+*/
+
+void* memset(void* dest, int value, size_t n);
+
+// regions must not overlap, use memmove for that
+void* memcpy(void* dest, const void* src, size_t n);
+
+// any overlap is fine
+void* memmove(void* dest, const void* src, size_t n);
+
+// fill count 32-bit words with value, for page tables/directories and bitmaps. dest should be 4-byte aligned
+void* memset32(void* dest, uint32_t value, size_t count);
+
+#endif
@@ -2,70 +2,278 @@
 #include "pmm.h"
 #include "paging.h"
 #include "kheap.h"
+#include "slab.h"
 #include "kprintf.h"
 #include "idt.h"
 #include "serial.h"
+#include "string.h"
 
 static vmm_address_space_t kernel_space;
 static vmm_address_space_t* current_space = NULL;
 
 
-// we could use kmalloc for these region structs but there's a chicken and egg issue
-// the heap itself is a region, so we need regions before we have a heap
-// 256 is plenty for now, even a complex process wont have more than maybe 20-30 regions (code, data, heap, stack, shared libs, mmap areas)
-static vmm_region_t region_pool[VMM_MAX_REGIONS];
-static uint32_t region_pool_used = 0;
+// region structs and address spaces come from their own object caches, not kmalloc. Those only need the PMM, so they work before
+// (and regardless of) the heap, which matters because the heap itself is a region. Freed ones go back on the cache's freelist and
+// get reused, so mapping/unmapping churn never runs out of slots or fragments the heap
+static slab_cache_t* region_cache = NULL;
+static slab_cache_t* space_cache = NULL;
 
 static vmm_region_t* alloc_region(void) {
-    if (region_pool_used >= VMM_MAX_REGIONS) {
-        // this would be pretty catastrophic but shouldn't happen rn with 256 slots
-        kprintf("VMM: ran out of region slots, this is bad\n");
+    vmm_region_t* r = cache_alloc(region_cache);
+    if (!r) {
+        kprintf("VMM: out of memory for region structs\n");
         return NULL;
     }
-    vmm_region_t* r = &region_pool[region_pool_used++];
     r->base = 0;
     r->size = 0;
     r->flags = 0;
     r->type = REGION_FREE;
-    r->next = NULL;
+    r->owns_frames = 0;
+    r->next = r->prev = NULL;
+    r->left = r->right = NULL;
+    r->height = 1;
+    r->gap = r->max_gap = 0;
     return r;
 }
 
-// keep this list sorted by base address so we can do gap-finding efficiently 
-// just walk the list and look for gaps between neighbors
+static void free_region(vmm_region_t* region) {
+    cache_free(region_cache, region);
+}
+
+// constructed state of an address space, vmm_destroy_address_space leaves it like this again before freeing it
+static void space_ctor(void* obj) {
+    vmm_address_space_t* space = (vmm_address_space_t*)obj;
+    space->page_directory = NULL;
+    space->regions = NULL;
+    space->region_tree = NULL;
+    space->last_hit = NULL;
+    space->region_count = 0;
+}
+
+// Region tree
+// every space keeps its regions twice: on the sorted list, for walking them in order and finding neighbours, and in an AVL tree keyed on
+// base, for finding the region an address falls in in O(log n), which is what every page fault does. regions never overlap, so ordering
+// them by base orders the whole ranges
+// The tree is also augmented for free range search: every region knows the size of the unmapped gap right before it, and every node
+// the largest such gap in its subtree, so a search can skip whole subtrees that have no hole big enough
+
+// page 0 is never handed out, a NULL dereference should always fault. the first region's gap starts above it
+#define VMM_LOWEST_ADDR PAGE_SIZE
+// nothing is placed in the very last page either, so base + size can't wrap
+#define VMM_HIGHEST_ADDR 0xFFFFF000
+
+static int32_t node_height(vmm_region_t* node) {
+    return node ? node->height : 0;
+}
+
+static uint32_t node_max_gap(vmm_region_t* node) {
+    return node ? node->max_gap : 0;
+}
+
+static void node_update(vmm_region_t* node) {
+    int32_t l = node_height(node->left);
+    int32_t r = node_height(node->right);
+    node->height = (l > r ? l : r) + 1;
+
+    uint32_t gap = node->gap;
+    if (node_max_gap(node->left) > gap) gap = node_max_gap(node->left);
+    if (node_max_gap(node->right) > gap) gap = node_max_gap(node->right);
+    node->max_gap = gap;
+}
+
+// region's gap changed, recompute max_gap on the path from the root down to it
+static void tree_refresh(vmm_region_t* root, vmm_region_t* region) {
+    if (!root) return;
+    if (region->base < root->base) {
+        tree_refresh(root->left, region);
+    } else if (region->base > root->base) {
+        tree_refresh(root->right, region);
+    }
+    node_update(root);
+}
+
+// the gap before a region runs from the end of the region before it (or the bottom of the address space) up to its base
+static void set_gap(vmm_region_t* region) {
+    uint32_t gap_start = region->prev ? region->prev->base + region->prev->size : VMM_LOWEST_ADDR;
+    region->gap = region->base > gap_start ? region->base - gap_start : 0;
+}
+
+static vmm_region_t* rotate_right(vmm_region_t* node) {
+    vmm_region_t* top = node->left;
+    node->left = top->right;
+    top->right = node;
+    node_update(node);
+    node_update(top);
+    return top;
+}
+
+static vmm_region_t* rotate_left(vmm_region_t* node) {
+    vmm_region_t* top = node->right;
+    node->right = top->left;
+    top->left = node;
+    node_update(node);
+    node_update(top);
+    return top;
+}
+
+// fix up a subtree whose children differ in height by at most 2, returns the new subtree root
+static vmm_region_t* rebalance(vmm_region_t* node) {
+    node_update(node);
+    int32_t balance = node_height(node->left) - node_height(node->right);
+    if (balance > 1) {
+        if (node_height(node->left->left) < node_height(node->left->right)) {
+            node->left = rotate_left(node->left);
+        }
+        return rotate_right(node);
+    }
+    if (balance < -1) {
+        if (node_height(node->right->right) < node_height(node->right->left)) {
+            node->right = rotate_right(node->right);
+        }
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static vmm_region_t* tree_insert(vmm_region_t* root, vmm_region_t* region) {
+    if (!root) return region;
+    if (region->base < root->base) {
+        root->left = tree_insert(root->left, region);
+    } else {
+        root->right = tree_insert(root->right, region);
+    }
+    return rebalance(root);
+}
+
+// detach the leftmost node of a subtree into *min
+static vmm_region_t* tree_remove_min(vmm_region_t* root, vmm_region_t** min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = tree_remove_min(root->left, min);
+    return rebalance(root);
+}
+
+static vmm_region_t* tree_remove(vmm_region_t* root, vmm_region_t* region) {
+    if (!root) return NULL;
+    if (region->base < root->base) {
+        root->left = tree_remove(root->left, region);
+    } else if (region->base > root->base) {
+        root->right = tree_remove(root->right, region);
+    } else {
+        // this is the one, its successor (leftmost of the right subtree) takes its place
+        if (!root->right) return root->left;
+        vmm_region_t* successor;
+        vmm_region_t* right = tree_remove_min(root->right, &successor);
+        successor->left = root->left;
+        successor->right = right;
+        return rebalance(successor);
+    }
+    return rebalance(root);
+}
+
+// the region with the highest base <= addr, NULL if they all start above it
+static vmm_region_t* tree_floor(vmm_region_t* node, uint32_t addr) {
+    vmm_region_t* best = NULL;
+    while (node) {
+        if (node->base <= addr) {
+            best = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return best;
+}
+
 static void insert_region(vmm_address_space_t* space, vmm_region_t* region) {
-    if (!space->regions || region->base < space->regions->base) {
-        region->next = space->regions;
+    // the list neighbour before it is the last region starting below it, the tree finds that without walking the list
+    vmm_region_t* prev = tree_floor(space->region_tree, region->base);
+    region->prev = prev;
+    region->next = prev ? prev->next : space->regions;
+    if (region->next) region->next->prev = region;
+    if (prev) {
+        prev->next = region;
+    } else {
         space->regions = region;
-        space->region_count++;
-        return;
     }
 
-    // walk the list to find where to insert
-    vmm_region_t* curr = space->regions;
-    while (curr->next && curr->next->base < region->base) {
-        curr = curr->next;
+    region->left = region->right = NULL;
+    region->height = 1;
+    set_gap(region);
+    region->max_gap = region->gap;
+    space->region_tree = tree_insert(space->region_tree, region);
+
+    // the new region took a bite out of the gap in front of the next one
+    if (region->next) {
+        set_gap(region->next);
+        tree_refresh(space->region_tree, region->next);
     }
-    region->next = curr->next;
-    curr->next = region;
     space->region_count++;
 }
 
 static void remove_region(vmm_address_space_t* space, vmm_region_t* region) {
-    if (space->regions == region) {
+    if (region->prev) {
+        region->prev->next = region->next;
+    } else {
         space->regions = region->next;
-        space->region_count--;
-        return;
     }
+    if (region->next) region->next->prev = region->prev;
 
-    vmm_region_t* curr = space->regions;
-    while (curr->next && curr->next != region) {
-        curr = curr->next;
+    space->region_tree = tree_remove(space->region_tree, region);
+    if (space->last_hit == region) space->last_hit = NULL;
+
+    // its range and the gap before it merge into the gap in front of the next region
+    if (region->next) {
+        set_gap(region->next);
+        tree_refresh(space->region_tree, region->next);
+    }
+    space->region_count--;
+}
+
+// leftmost region whose gap has room for size bytes at or above floor
+// a region starting within size of floor can't have room in front of it and neither can anything left of it, past that max_gap
+// tells us whether a subtree is worth going into
+static vmm_region_t* gap_search_up(vmm_region_t* node, uint32_t floor, uint32_t size) {
+    if (!node || node->max_gap < size) return NULL;
+    if (node->base <= floor || node->base - floor < size) {
+        return gap_search_up(node->right, floor, size);
     }
-    if (curr->next == region) {
-        curr->next = region->next;
-        space->region_count--;
+
+    vmm_region_t* found = gap_search_up(node->left, floor, size);
+    if (found) return found;
+
+    uint32_t gap_start = node->base - node->gap;
+    if (gap_start < floor) gap_start = floor;
+    if (node->base - gap_start >= size) return node;
+
+    return gap_search_up(node->right, floor, size);
+}
+
+// rightmost region whose gap has room for size bytes below ceiling, the mirror image of gap_search_up
+static vmm_region_t* gap_search_down(vmm_region_t* node, uint32_t ceiling, uint32_t size) {
+    if (!node || node->max_gap < size) return NULL;
+    uint32_t gap_start = node->base - node->gap;
+    if (gap_start >= ceiling || ceiling - gap_start < size) {
+        return gap_search_down(node->left, ceiling, size);
     }
+
+    vmm_region_t* found = gap_search_down(node->right, ceiling, size);
+    if (found) return found;
+
+    uint32_t gap_end = node->base < ceiling ? node->base : ceiling;
+    if (gap_end - gap_start >= size) return node;
+
+    return gap_search_down(node->left, ceiling, size);
+}
+
+// end of the highest region, where the gap that isn't in front of any region starts
+static uint32_t regions_end(vmm_address_space_t* space) {
+    vmm_region_t* node = space->region_tree;
+    if (!node) return VMM_LOWEST_ADDR;
+    while (node->right) node = node->right;
+    return node->base + node->size;
 }
 
 
@@ -85,6 +293,103 @@ static vmm_region_t* register_existing_region(vmm_address_space_t* space, uint32
     return region;
 }
 
+// which zone a region's frames come from. user pages don't need to be in the direct map, so they come from high memory and leave the
+// low zones for the kernel. whether the region owns its frames at all is region->owns_frames, not the type
+static uint32_t region_alloc_flags(vmm_region_type_t type) {
+    return type >= REGION_USER_CODE && type <= REGION_USER_STACK ? PMM_ALLOC_HIGH : PMM_ALLOC_KERNEL;
+}
+
+// frame source for paging_map_range: a fresh zeroed frame for every page, counted as mapped in its descriptor
+// the frame has to be zeroed. this is important for security (don't leak data from previous allocations) and for sanity (bss excepts zeroes)
+// the PMM keeps a pool of frames zeroed ahead of time by an idle thread so we don't pay for it here
+static uint32_t region_frame_source(void* ctx) {
+    uint32_t alloc_flags = *(uint32_t*)ctx;
+    uint32_t phys = (uint32_t)pmm_alloc_zeroed_frame(alloc_flags);
+    if (!phys) return 0;
+
+    page_t* page = pmm_frame_desc(phys);
+    if (page && page->mapcount < 0xFF) page->mapcount++;
+    return phys;
+}
+
+// frame sink for paging_unmap_range: drop the reference the mapping held, the frame only goes back to the PMM if nobody else shares it
+static void region_frame_sink(uint32_t phys, void* ctx) {
+    (void)ctx;
+    page_t* page = pmm_frame_desc(phys);
+    if (page && page->mapcount > 0 && page->mapcount < 0xFF) page->mapcount--;
+    pmm_put_frame(phys);
+}
+
+// for paging_share_range: the clone's mapping is one more reference on the frame
+static void region_frame_share(uint32_t phys, void* ctx) {
+    (void)ctx;
+    pmm_get_frame(phys);
+    page_t* page = pmm_frame_desc(phys);
+    if (page && page->mapcount < 0xFF) page->mapcount++;
+}
+
+static uint32_t vmm_flags_to_page_flags(uint32_t vmm_flags) {
+    uint32_t pf = PAGE_PRESENT;
+    if (vmm_flags & VMM_WRITE) pf |= PAGE_WRITE;
+    if (vmm_flags & VMM_USER) pf |= PAGE_USER;
+    return pf;
+}
+
+// back the page containing addr in a VMM_LAZY region. -1 if the access isn't allowed by the region (so it's a real fault) or we're out of memory
+// kernel-half regions map into the shared kernel tables, so the page shows up in every address space at once
+static int demand_page(vmm_address_space_t* space, vmm_region_t* region, uint32_t addr, int write, int user) {
+    if (!(region->flags & VMM_LAZY)) return -1;
+    if (write && !(region->flags & VMM_WRITE)) return -1;
+    if (user && !(region->flags & VMM_USER)) return -1;
+
+    uint32_t alloc_flags = region_alloc_flags(region->type);
+    uint32_t page = addr & ~(PAGE_SIZE - 1);
+    // one page, so either it got mapped or nothing did
+    return paging_map_range(space->page_directory, page, PAGE_SIZE, vmm_flags_to_page_flags(region->flags), region_frame_source, &alloc_flags);
+}
+
+// copy-on-write: a write fault on a present page of a region that allows writing means the page's frame is shared with a clone
+// (the PTE was made read-only by paging_share_range). the faulting space gets its own copy, or, if every other sharer already copied
+// or went away, simply gets write access back to the frame it has
+static int cow_page(vmm_region_t* region, uint32_t addr, int user) {
+    if (!region->owns_frames || !(region->flags & VMM_WRITE)) return -1;
+    if (user && !(region->flags & VMM_USER)) return -1;
+
+    // the fault happened in whatever CR3 holds, which is what paging_get_physical/paging_map_page work on
+    uint32_t page = addr & ~(PAGE_SIZE - 1);
+    uint32_t old_phys = paging_get_physical(page);
+    page_t* old_desc = pmm_frame_desc(old_phys);
+    if (!old_phys || !old_desc) return -1;
+
+    uint32_t page_flags = vmm_flags_to_page_flags(region->flags);
+    if (old_desc->refcount == 1) {
+        paging_map_page(page, old_phys, page_flags);
+        return 0;
+    }
+
+    uint32_t new_phys = (uint32_t)pmm_alloc_frame_flags(PMM_ALLOC_HIGH);
+    if (!new_phys) return -1;
+
+    // both are user frames, likely high memory, so they go through kmap slots
+    void* from = paging_kmap(old_phys);
+    void* to = paging_kmap(new_phys);
+    if (!from || !to) {
+        paging_kunmap(from);
+        paging_kunmap(to);
+        pmm_free_frame((void*)new_phys);
+        return -1;
+    }
+    memcpy(to, from, PAGE_SIZE);
+    paging_kunmap(to);
+    paging_kunmap(from);
+
+    page_t* new_desc = pmm_frame_desc(new_phys);
+    if (new_desc && new_desc->mapcount < 0xFF) new_desc->mapcount++;
+    paging_map_page(page, new_phys, page_flags);
+    region_frame_sink(old_phys, NULL); // our share of the old frame, the other sharers keep it
+    return 0;
+}
+
 // ISR 14 PAGE FAULT HANDLER
 // This is where the magic happens, or where shit blows up :(, when the cpu tries to access a virtual addr, that's either not mapped or has the wrong perms
 // it triggers interrupt 14 and puts the faulting address in the CR2 register
@@ -94,9 +399,9 @@ static vmm_region_t* register_existing_region(vmm_address_space_t* space, uint32
 // bit 1: 0 = read access, 1 = write access
 // bit 2: 0 = kernel mode, 1 = user mode
 
-// right now we mostly just print helpful debug info and halt. But the structure is here for demand paging:
-// if a region exists but the page isn't present, we could allocate a frame on the fly instead of panicking
-
+// a fault on a page that isn't present, inside a region mapped with VMM_LAZY, is demand paging: we allocate a zeroed frame, map it,
+// and return so the faulting instruction runs again. a write to a present page in a writable region is copy-on-write (see cow_page),
+// resolved the same way. anything else we print helpful debug info for and halt
 static void page_fault_handler(struct interrupt_frame* frame) {
     // CR2 holds the virtual addr that caused the fault, the CPU loads this automatically, we just need to read it
     uint32_t faulting_addr;
@@ -106,6 +411,18 @@ static void page_fault_handler(struct interrupt_frame* frame) {
     int write = frame->error_code & 0x2; // was it a write?
     int user = frame->error_code & 0x4; // were we in user mode?
 
+    // kernel-half addresses are looked up in the kernel's list whatever space we're in, vmm_find_region takes care of that
+    vmm_address_space_t* space = current_space;
+    vmm_region_t* region = space ? vmm_find_region(space, faulting_addr) : NULL;
+
+    // first touch of a demand paged page or a write to a copy-on-write one, the common cases, so they go before all the printing
+    if (region && !present && demand_page(current_space, region, faulting_addr, write, user) == 0) {
+        return;
+    }
+    if (region && present && write && cow_page(region, faulting_addr, user) == 0) {
+        return;
+    }
+
     // print something useful so we can actually debug this, without this handler, a page fault just triple faults the CPU and QEMU reboots with zero indication of what went wrong
     // ask me how many hours I wasted before adding this...
     kprintf("\n!!!!!!! PAGE FAULT !!!!!!!!!!");
@@ -118,22 +435,17 @@ static void page_fault_handler(struct interrupt_frame* frame) {
     serial_printf("PAGE FAULT: addr=0x%x err=0x%x eip=0x%x\n", faulting_addr, frame->error_code, frame->eip);
 
     // check if the faulting addr falls inside a known region, if it does the access is "logically valid", the memory was supposed to be there we just havent set up the page yet
-    // this is the hook point for demand paging later
-    if (current_space) {
-        vmm_region_t* region = vmm_find_region(current_space, faulting_addr);
-
+    if (space) {
         if (region && !present) {
-            /*
-             * the address is in a valid region but the page isn't mapped yet.
-             * this is where demand paging would go, allocate a physical frame,
-             * map it, and return from the fault like nothing happened.
-             *
-             * for now though, we're not doing demand paging yet, so if we hit
-             * this it means something didn't get mapped that should have been.
-             * still useful to know it's a known region vs total garbage */
-             kprintf(" -> Address is in region: type=%u, base=0x%x, size=0x%x\n", region->type, region->base, region->size);
-             kprintf(" -> This region exists but page isn't present\n");
-             kprintf(" -> (demand paging not implemented yet, halting)\n");
+            kprintf(" -> Address is in region: type=%u, base=0x%x, size=0x%x\n", region->type, region->base, region->size);
+            if (!(region->flags & VMM_LAZY)) {
+                // eagerly mapped regions are fully backed, so something unmapped a page behind the VMM's back
+                kprintf(" -> This region exists but page isn't present (and it isn't demand paged)\n");
+            } else if ((write && !(region->flags & VMM_WRITE)) || (user && !(region->flags & VMM_USER))) {
+                kprintf(" -> Demand paged region doesn't allow this access\n");
+            } else {
+                kprintf(" -> Out of memory for demand paging\n");
+            }
         } else if (region && present) {
             // the page IS present but we still faulted, which means it's a permission violation.
             // tried to write to a RO page, or user mode tried to touch a supervisor page
@@ -156,23 +468,25 @@ static void page_fault_handler(struct interrupt_frame* frame) {
     __asm__ volatile("cli; hlt");
 }
 
-static uint32_t vmm_flags_to_page_flags(uint32_t vmm_flags) {
-    uint32_t pf = PAGE_PRESENT;
-    if (vmm_flags & VMM_WRITE) pf |= PAGE_WRITE;
-    if (vmm_flags & VMM_USER) pf |= PAGE_USER;
-    return pf;
-}
-
 void vmm_init(void) {
     kprintf("VMM: Initializing...\n");
 
+    region_cache = cache_create("vmm_region", sizeof(vmm_region_t), 0, NULL);
+    space_cache = cache_create("vmm_space", sizeof(vmm_address_space_t), 0, space_ctor);
+    if (!region_cache || !space_cache) {
+        kprintf("VMM: couldn't create the region / address space caches\n");
+        return;
+    }
+
     // paging_init already created the page dir so we just need to set up the kernel address space
     kernel_space.page_directory = paging_get_directory();
     kernel_space.regions = NULL;
+    kernel_space.region_tree = NULL;
+    kernel_space.last_hit = NULL;
     kernel_space.region_count = 0;
     current_space = &kernel_space;
 
-    // register the regions that already exist, paging_init identity-mapped the first 16MB, and kheap_init carved out a heap starting at 0x400000
+    // register the regions that already exist, paging_init mapped RAM (up to 896MB) at 0xC0000000, and kheap_init carved out a heap at KHEAP_START
     // we need to tell the VMM about these so it doesn't try to map something on top of them
 
     // first 4KB is intentionally left unmapped as a null guard page, any null pointer dereference will fault immediately instead of silently reading/writing address 0
@@ -188,15 +502,17 @@ void vmm_init(void) {
     register_existing_region(&kernel_space, 0xC0100000, kend - 0xC0100000, VMM_READ | VMM_WRITE | VMM_EXEC, REGION_KERNEL_CODE);
 
 
-    // the rest of the identity mapped area between kernel end and where the heap starts
-    // we cap it at 0x400000 (heap start) instead of 0x1000000 (16MB) because the heap
-    // takes over from 0x400000 onward and we don't want overlapping regions
-    if (kend < 0xC0400000) {
-        register_existing_region(&kernel_space, kend, 0xC0400000 - kend, VMM_READ | VMM_WRITE, REGION_IDENTITY_MAP);
+    // the rest of the direct map, from kernel end up to wherever paging_init stopped (PMM bookkeeping lives right after the kernel in here too)
+    uint32_t direct_map_end = PHYS_TO_VIRT(paging_get_direct_map_end());
+    if (kend < direct_map_end) {
+        register_existing_region(&kernel_space, kend, direct_map_end - kend, VMM_READ | VMM_WRITE, REGION_IDENTITY_MAP);
     }
 
-    // the kernel heap at 0x400000, the kheap manages its own expansion, but we want the VMM to know this range is spoken for so the vmm_find_free_region won't hand out addresses in the middle of the heap
-    register_existing_region(&kernel_space, 0xC0400000, 16 * 1024 * 1024, VMM_READ | VMM_WRITE, REGION_KERNEL_HEAP);
+    // the kernel heap, the kheap manages its own expansion, but we want the VMM to know this range is spoken for so the vmm_find_free_region won't hand out addresses in the middle of the heap
+    register_existing_region(&kernel_space, KHEAP_START, KHEAP_MAX_SIZE, VMM_READ | VMM_WRITE, REGION_KERNEL_HEAP);
+
+    // kmap slots for temporary mappings of high memory
+    register_existing_region(&kernel_space, KMAP_BASE, KMAP_SLOTS * PAGE_SIZE, VMM_READ | VMM_WRITE, REGION_KERNEL_DATA);
 
     // install the page fault handler. ISR 14 is the page fault exception. without this, any page fault causes a double fault which causes a triple fault which reboots the machine
     // not exactly helpful for debugging
@@ -207,8 +523,8 @@ void vmm_init(void) {
 }
 
 vmm_address_space_t* vmm_create_address_space(void) {
-    // allocate address space struct from the heap
-    vmm_address_space_t* space = (vmm_address_space_t*)kmalloc(sizeof(vmm_address_space_t));
+    // comes out of its cache already in the empty state (no directory, no regions)
+    vmm_address_space_t* space = cache_alloc(space_cache);
     if (!space) {
         kprintf("VMM: couldn't allocate address space struct\n");
         return NULL;
@@ -219,20 +535,43 @@ vmm_address_space_t* vmm_create_address_space(void) {
     space->page_directory = paging_create_directory();
     if (!space->page_directory) {
         kprintf("VMM: couldn't create page directory\n");
-        kfree(space);
+        cache_free(space_cache, space);
         return NULL;
     }
 
-    space->regions = NULL;
-    space->region_count = 0;
+    // no region bookkeeping to copy either: the kernel half's regions stay on the kernel space's list, which every space shares
+    return space;
+}
 
-    // copy the kernel regions into the new address space's region list, the page tables are already shared but we need the VMM's bookkeeping to match
-    vmm_region_t* kr = kernel_space.regions;
-    while (kr) {
-        register_existing_region(space, kr->base, kr->size, kr->flags, kr->type);
-        kr = kr->next;
+vmm_address_space_t* vmm_clone_address_space(vmm_address_space_t* parent) {
+    if (!parent) return NULL;
+    if (parent == &kernel_space) {
+        // its regions are the kernel half every space shares already, vmalloc buffers and all. cloning them would put kernel regions
+        // on a process's list and make their pages shared read-only
+        kprintf("VMM: refusing to clone the kernel address space\n");
+        return NULL;
     }
-    return space;
+
+    vmm_address_space_t* child = vmm_create_address_space();
+    if (!child) return NULL;
+
+    // the kernel regions are shared already, the user ones get the same region and every present page shared read-only.
+    // nothing gets copied until one side writes to a page
+    vmm_region_t* region = parent->regions;
+    while (region) {
+        if (region->owns_frames) {
+            // in the child's list before its pages are, so a failure halfway is cleaned up by vmm_destroy_address_space
+            vmm_region_t* copy = register_existing_region(child, region->base, region->size, region->flags, region->type);
+            if (copy) copy->owns_frames = 1; // its own reference on every shared frame
+            if (!copy || paging_share_range(parent->page_directory, child->page_directory, region->base, region->size, region_frame_share, NULL) < 0) {
+                kprintf("VMM: out of memory cloning address space\n");
+                vmm_destroy_address_space(child);
+                return NULL;
+            }
+        }
+        region = region->next;
+    }
+    return child;
 }
 
 void vmm_destroy_address_space(vmm_address_space_t* space) {
@@ -242,30 +581,29 @@ void vmm_destroy_address_space(vmm_address_space_t* space) {
         return;
     }
 
-    // walk the line for all regions and free the ones that aren't kernel regions
+    // a loaded directory can't be freed (paging_destroy_directory would refuse and leak it), move CR3 off it first. the kernel half
+    // is the same in every directory, so whoever is running here (the exiting process's last kernel path) carries on fine
+    if (current_space == space || paging_get_loaded_directory() == space->page_directory) {
+        vmm_switch_address_space(&kernel_space);
+    }
+
+    // walk the line for all regions and drop the frames of the ones that own theirs, the region structs all go back to their cache
     vmm_region_t* region = space->regions;
     while (region) {
         vmm_region_t* next = region->next;
 
-        if (region->type >= REGION_USER_CODE) {
-            uint32_t addr = region->base;
-            uint32_t end = region->base + region->size;
-            while (addr < end) {
-                uint32_t phys = paging_get_physical(addr);
-                if (phys) {
-                    paging_unmap_page(addr);
-                    pmm_free_frame((void*)phys);
-                }
-                addr += PAGE_SIZE;
-            }
+        if (region->owns_frames) {
+            paging_unmap_range(space->page_directory, region->base, region->size, region_frame_sink, NULL);
         }
+        free_region(region);
 
         region = next;
     }
 
-    // free the page dir itself
-    pmm_free_frame(space->page_directory);
-    kfree(space);
+    // free the page dir itself, along with the page tables of its user half
+    paging_destroy_directory(space->page_directory);
+    space_ctor(space);
+    cache_free(space_cache, space);
 }
 
 void vmm_switch_address_space(vmm_address_space_t* space) {
@@ -290,53 +628,42 @@ int vmm_map_region(vmm_address_space_t* space, uint32_t vaddr, uint32_t size, ui
     if (!space) return -1;
     if (vaddr & (PAGE_SIZE - 1)) return -1; // must be page-aligned
     if (size & (PAGE_SIZE - 1)) return -1;
+    if (size == 0 || vaddr + size - 1 < vaddr) return -1; // empty or wraps past 4GB
 
-    // make sure this range doesn't overlap with an existing region, we walk the whole list and check
-    // not the fastest approach but with <256 regions it doesn't matter tbh
-    vmm_region_t* existing = space->regions;
-    while (existing) {
-        uint32_t existing_end = existing->base + existing->size;
-        uint32_t new_end = vaddr + size;
+    // the kernel half is shared by every space and its regions live in the kernel's list, a process can't map anything there
+    if (space != &kernel_space && vaddr + size > KERNEL_VIRTUAL_BASE) {
+        kprintf("VMM: 0x%x-0x%x reaches into the kernel half, map it in the kernel space\n", vaddr, vaddr + size);
+        return -1;
+    }
 
-        if (vaddr < existing_end && new_end > existing->base) {
-            kprintf("VMM: region overlap! 0x%x-0x%x conflicts with 0x%x-0x%x\n", vaddr, new_end, existing->base, existing_end);
-            return -1;
-        }
-        existing = existing->next;
-    }
-
-    uint32_t page_flags = vmm_flags_to_page_flags(flags);
-    for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
-        void* frame = pmm_alloc_frame();
-        if (!frame) {
-            // out of physical memory, undo what we already mapped.
-            // this isn't the prettiest rollback but it works
-            kprintf("VMM: out of physical memory during map\n");
-            for (uint32_t undo = 0; undo < offset; undo += PAGE_SIZE) {
-                uint32_t phys = paging_get_physical(vaddr + undo);
-                paging_unmap_page(vaddr + undo);
-                if (phys) pmm_free_frame((void*)(phys & 0xFFFFF000));
-            }
-            return -1;
-        }
+    // new directories copy the kernel PDEs once when they're created, so a kernel mapping is only seen everywhere if its page table
+    // already existed then. paging_init preallocates them from KHEAP_START up, below that is the direct map and the unbacked gap after it
+    if (space == &kernel_space && vaddr + size > KERNEL_VIRTUAL_BASE && vaddr < KHEAP_START) {
+        kprintf("VMM: 0x%x-0x%x is below the kernel heap, only KHEAP_START and up is shared by every space\n", vaddr, vaddr + size);
+        return -1;
+    }
 
-        paging_map_page(vaddr + offset, (uint32_t)frame, page_flags);
+    // make sure this range doesn't overlap with an existing region. regions don't overlap each other, so the only candidate
+    // is the last one starting before the new range ends
+    vmm_region_t* existing = tree_floor(space->region_tree, vaddr + size - 1);
+    if (existing && existing->base + existing->size > vaddr) {
+        kprintf("VMM: region overlap! 0x%x-0x%x conflicts with 0x%x-0x%x\n", vaddr, vaddr + size, existing->base, existing->base + existing->size);
+        return -1;
+    }
 
-        // zero out the page. this is important for security (don't leak data from previous allocations) and for sanity (bss excepts zeroes)
-        uint8_t* page_ptr = (uint8_t*)(vaddr + offset);
-        for (uint32_t i = 0; i < PAGE_SIZE; i++) {
-            page_ptr[i] = 0;
-        }
+    // lazy regions skip this entirely, the page fault handler backs them a page at a time
+    uint32_t alloc_flags = region_alloc_flags(type);
+    if (!(flags & VMM_LAZY) && paging_map_range(space->page_directory, vaddr, size, vmm_flags_to_page_flags(flags), region_frame_source, &alloc_flags) < 0) {
+        // out of physical memory, undo what we already mapped
+        kprintf("VMM: out of physical memory during map\n");
+        paging_unmap_range(space->page_directory, vaddr, size, region_frame_sink, NULL);
+        return -1;
     }
 
     // create the region tracking entry
     vmm_region_t* region = alloc_region();
     if (!region) {
-        for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
-            uint32_t phys = paging_get_physical(vaddr + offset);
-            paging_unmap_page(vaddr + offset);
-            if (phys) pmm_free_frame((void*)(phys & 0xFFFFF000));
-        }
+        paging_unmap_range(space->page_directory, vaddr, size, region_frame_sink, NULL);
         return -1;
     }
 
@@ -344,6 +671,7 @@ int vmm_map_region(vmm_address_space_t* space, uint32_t vaddr, uint32_t size, ui
     region->size = size;
     region->flags = flags;
     region->type = type;
+    region->owns_frames = 1; // allocated here or by demand paging, whatever the type
     insert_region(space, region);
 
     return 0;
@@ -353,13 +681,8 @@ int vmm_unmap_region(vmm_address_space_t* space, uint32_t vaddr) {
     if (!space) return -1;
 
     // find the region that starts at this exact address
-    vmm_region_t* region = space->regions;
-    while (region) {
-        if (region->base == vaddr) break;
-        region = region->next;
-    }
-
-    if (!region) {
+    vmm_region_t* region = tree_floor(space->region_tree, vaddr);
+    if (!region || region->base != vaddr) {
         kprintf("VMM: no region at 0x%x to unmap\n", vaddr);
         return -1;
     }
@@ -370,81 +693,152 @@ int vmm_unmap_region(vmm_address_space_t* space, uint32_t vaddr) {
         return -1;
     }
 
-    // unmap each page and free the physical frame behind it
-    for (uint32_t offset = 0; offset < region->size; offset += PAGE_SIZE) {
-        uint32_t addr = region->base + offset;
-        uint32_t phys = paging_get_physical(addr);
-        if (phys) {
-            paging_unmap_page(addr);
-            pmm_free_frame((void*)(phys & 0xFFFFF000));
-        }
-    }
+    // unmap each page and drop its reference, frames shared with another mapping stay alive. a region that only registered memory
+    // someone else manages just loses the mapping
+    paging_unmap_range(space->page_directory, region->base, region->size, region->owns_frames ? region_frame_sink : NULL, NULL);
 
     remove_region(space, region);
+    free_region(region);
     return 0;
 }
 
+// a process's own regions are all in the user half, the kernel space can place things anywhere
+static uint32_t space_limit(vmm_address_space_t* space) {
+    return space == &kernel_space ? VMM_HIGHEST_ADDR : KERNEL_VIRTUAL_BASE;
+}
+
 uint32_t vmm_find_free_region(vmm_address_space_t* space, uint32_t size, uint32_t start_hint) {
     if (!space) return 0;
 
     // align everything to page boundaries
     size = (size + PAGE_SIZE -1) & ~(PAGE_SIZE - 1);
-    if (start_hint == 0) start_hint = 0xD0000000; // default: above initial kernel regions
+    uint32_t limit = space_limit(space);
+    if (start_hint == 0) start_hint = space == &kernel_space ? VMALLOC_START : VMM_LOWEST_ADDR; // default: the vmalloc window / the bottom of the user half
+    // nothing in the kernel half below the heap can be mapped (see vmm_map_region), don't hand it out
+    if (space == &kernel_space && start_hint >= KERNEL_VIRTUAL_BASE && start_hint < KHEAP_START) start_hint = VMALLOC_START;
     start_hint = (start_hint + PAGE_SIZE -1) & ~(PAGE_SIZE - 1);
+    if (start_hint < VMM_LOWEST_ADDR) start_hint = VMM_LOWEST_ADDR;
 
-    // walk the line looking for gaps
-    uint32_t candidate = start_hint;
-    vmm_region_t* region = space->regions;
+    // the lowest gap at or above the hint that fits, if there's one in front of some region
+    vmm_region_t* region = gap_search_up(space->region_tree, start_hint, size);
+    if (region) {
+        uint32_t gap_start = region->base - region->gap;
+        return gap_start > start_hint ? gap_start : start_hint;
+    }
 
-    while (region) {
-        uint32_t region_end = region->base + region->size;
+    // past the last region
+    uint32_t candidate = regions_end(space);
+    if (candidate < start_hint) candidate = start_hint;
+    if (candidate <= limit && limit - candidate >= size) return candidate;
 
-        // if candidate overlaps this region, skip it
-        if (candidate >= region->base && candidate < region_end) {
-            candidate = region_end;
-            candidate = (candidate + PAGE_SIZE -1) & ~(PAGE_SIZE - 1);
-        }
+    // ran out of address space, on 32-bit that's 4GB total, minus kernel regions, so this shouldn't happen unless something is way off
+    kprintf("VMM: no free region of size 0x%x found\n", size);
+    return 0;
+}
 
-        // check if there's enough room between here and next region
-        if (candidate + size <= (region->next ? region->next->base : 0xFFFFF000)) {
-            return candidate;
-        }
-        region = region->next;
+uint32_t vmm_find_free_region_top_down(vmm_address_space_t* space, uint32_t size, uint32_t ceiling) {
+    if (!space) return 0;
+
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (ceiling == 0) ceiling = space == &kernel_space ? VMALLOC_END : KERNEL_VIRTUAL_BASE; // default: the top of the vmalloc window / of the user half
+    if (ceiling > space_limit(space)) ceiling = space_limit(space);
+    ceiling &= ~(PAGE_SIZE - 1);
+
+    // in the kernel half the kernel space can only map from KHEAP_START up (see vmm_map_region), a gap under that doesn't count.
+    // the heap region starts right at KHEAP_START, so no gap straddles it and it's enough to check where the answer lands
+    uint32_t floor = (space == &kernel_space && ceiling > KERNEL_VIRTUAL_BASE) ? KHEAP_START : 0;
+
+    // the gap above the last region is the highest one there is
+    uint32_t end = regions_end(space);
+    if (end < ceiling && ceiling - end >= size && ceiling - size >= floor) return ceiling - size;
+
+    vmm_region_t* region = gap_search_down(space->region_tree, ceiling, size);
+    if (region) {
+        uint32_t gap_end = region->base < ceiling ? region->base : ceiling;
+        if (gap_end - size >= floor) return gap_end - size;
     }
 
-    // ran out of address space, on 32-bit that's 4GB total, minus kernel regions, so this shouldn't happen unless something is way off
-    kprintf("VMM: no free region of size 0x%x found\n", size);
+    kprintf("VMM: no free region of size 0x%x found below 0x%x\n", size, ceiling);
     return 0;
 }
 
 vmm_region_t* vmm_find_region(vmm_address_space_t* space, uint32_t vaddr) {
     if (!space) return NULL;
+    if (vaddr >= KERNEL_VIRTUAL_BASE) space = &kernel_space; // the one shared list for the kernel half
 
-    vmm_region_t* region = space->regions;
-    while (region) {
-        if (vaddr >= region->base && vaddr < region->base + region->size) {
-            return region;
-        }
-        region = region->next;
-    }
-    return NULL;
+    // faults come in runs on the same region (a loop walking a buffer, a stack growing), so check the last one we found first
+    vmm_region_t* region = space->last_hit;
+    if (region && vaddr - region->base < region->size) return region;
+
+    region = tree_floor(space->region_tree, vaddr);
+    if (!region || vaddr - region->base >= region->size) return NULL;
+    space->last_hit = region;
+    return region;
 }
 
 int vmm_is_mapped(uint32_t vaddr) {
     return paging_get_physical(vaddr) != 0;
 }
 
+void* vmalloc(size_t size) {
+    if (size == 0) return NULL;
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    // the region covers the guard page too, so nothing else can be placed in it
+    uint32_t span = size + VMALLOC_GUARD_SIZE;
+    if (span < size) return NULL;
+    uint32_t vaddr = vmm_find_free_region(&kernel_space, span, VMALLOC_START);
+    if (!vaddr || vaddr < VMALLOC_START || vaddr > VMALLOC_END - span) {
+        kprintf("VMM: vmalloc window has no room for %u KB\n", size / 1024);
+        return NULL;
+    }
+
+    // only the kernel ever touches these pages and only through this mapping, so they can come from high memory
+    uint32_t alloc_flags = PMM_ALLOC_HIGH;
+    if (paging_map_range(kernel_space.page_directory, vaddr, size, PAGE_PRESENT | PAGE_WRITE, region_frame_source, &alloc_flags) < 0) {
+        kprintf("VMM: out of physical memory during vmalloc\n");
+        paging_unmap_range(kernel_space.page_directory, vaddr, size, region_frame_sink, NULL);
+        return NULL;
+    }
+
+    vmm_region_t* region = register_existing_region(&kernel_space, vaddr, span, VMM_READ | VMM_WRITE, REGION_VMALLOC);
+    if (!region) {
+        paging_unmap_range(kernel_space.page_directory, vaddr, size, region_frame_sink, NULL);
+        return NULL;
+    }
+    region->owns_frames = 1;
+    return (void*)vaddr;
+}
+
+void vfree(void* ptr) {
+    if (!ptr) return;
+
+    vmm_region_t* region = vmm_find_region(&kernel_space, (uint32_t)ptr);
+    if (!region || region->type != REGION_VMALLOC || region->base != (uint32_t)ptr) {
+        kprintf("VMM: vfree of 0x%x, not a vmalloc buffer\n", (uint32_t)ptr);
+        return;
+    }
+
+    // the guard page was never mapped, unmapping the whole region just steps over it
+    paging_unmap_range(kernel_space.page_directory, region->base, region->size, region_frame_sink, NULL);
+    remove_region(&kernel_space, region);
+    free_region(region);
+}
+
 void vmm_dump_regions(vmm_address_space_t* space) {
     if (!space) return;
 
     // names for each region type so output is readable
-    const char* type_names[] = {"FREE", "KCODE", "KDATA", "KHEAP", "KSTACK", "IDMAP", "UCODE", "UDATA", "UHEAP", "USTACK", "MMIO"};
+    const char* type_names[] = {"FREE", "KCODE", "KDATA", "KHEAP", "KSTACK", "IDMAP", "UCODE", "UDATA", "UHEAP", "USTACK", "MMIO", "VMALLOC"};
 
     kprintf("VMM: --- Region Map (%u regions) ---\n", space->region_count);
+    if (space != &kernel_space) {
+        kprintf(" (plus the %u kernel regions every space shares)\n", kernel_space.region_count);
+    }
     vmm_region_t* r = space->regions;
     while (r) {
-        const char* name = (r->type <= REGION_MMIO ? type_names[r->type] : "???");
-        kprintf(" 0x%x - 0x%x  [%s] %s%s%s\n", r->base, r->base + r->size, name, (r->flags & VMM_READ) ? "R" : "-", (r->flags & VMM_WRITE) ? "W" : "-", (r->flags & VMM_USER) ? "U" : "K");
+        const char* name = (r->type <= REGION_VMALLOC ? type_names[r->type] : "???");
+        kprintf(" 0x%x - 0x%x  [%s] %s%s%s%s\n", r->base, r->base + r->size, name, (r->flags & VMM_READ) ? "R" : "-", (r->flags & VMM_WRITE) ? "W" : "-", (r->flags & VMM_USER) ? "U" : "K", (r->flags & VMM_LAZY) ? " lazy" : "");
         r = r->next;
     }
     kprintf("VMM: --- End Region Map ---\n");
@@ -16,8 +16,8 @@
 * each process will get its own address space with its own page directory. The VMM is what makes that switch seamless
 
 * The other big thing is the page fault handler. Without it, any access to an unmapped page causes a triple fault and QEMU just
-* reboots with no explanation. The VMM hooks ISR 14 and gives us actual error messages, plus it sets us up for demand paging later
-* (where we don't bother allocating physical frames until someone actually touches the page).
+* reboots with no explanation. The VMM hooks ISR 14 and gives us actual error messages, and it does demand paging for regions
+* mapped with VMM_LAZY (we don't bother allocating physical frames until someone actually touches the page).
 */
 
 // These describe what a region is being used for, mostly for bokkeeping and debugging right now
@@ -29,12 +29,13 @@ typedef enum {
     REGION_KERNEL_DATA, // kernel .data and .bss (globals, statics)
     REGION_KERNEL_HEAP, // kmalloc territory (managed by kheap naturally)
     REGION_KERNEL_STACK, // kernel stack (the one set up in boot.asm)
-    REGION_IDENTITY_MAP, // the first 16 MB identity map we set up in paging_init
+    REGION_IDENTITY_MAP, // the direct map of RAM at 0xC0000000 we set up in paging_init
     REGION_USER_CODE, // future: user process copde
     REGION_USER_DATA, // future: user process data
     REGION_USER_HEAP, // future: user process heap (brk/sbrk)
     REGION_USER_STACK, // future: user process stack
     REGION_MMIO, // memory-mapped I/O 
+    REGION_VMALLOC, // a vmalloc buffer (plus its guard page), kernel space only
 } vmm_region_type_t;
 
 // permission flags for regions, these map pretty directly to the page table entry flags, but we track them separately
@@ -43,26 +44,34 @@ typedef enum {
 #define VMM_WRITE 0x02 // region can be written to
 #define VMM_EXEC 0x04 // region contains executable code (no NX bit on i686 though)
 #define VMM_USER 0x08 // accessible from ring 3 (user mode)
+#define VMM_LAZY 0x10 // demand paged: no frames up front, the page fault handler maps a zeroed one the first time each page is touched
 
 // a virtual memory region. this tracks a contiguous range of virtual addresses that share the same perms and purpose
-// similar concept to linux's vm_area_struct but way simpler cause we don't need to handle shared libs, mmap, copy-on-write or any of that stuff yet
+// similar concept to linux's vm_area_struct but way simpler cause we don't need to handle shared libs or mmap yet
 typedef struct vmm_region {
     uint32_t base; // starting virtual address (page aligned)
     uint32_t size; // size in bytes (multiple of PAGE_SIZE)
     uint32_t flags; // VMM_READ | VMM_WRITE etc.
     vmm_region_type_t type; // what this region is for
+    uint32_t owns_frames; // the frames behind it were allocated for it (vmm_map_region, vmalloc, a clone's shares), unmapping frees them
     struct vmm_region* next; // linked list, sorted by base address
+    struct vmm_region* prev;
+    struct vmm_region* left; // region tree (AVL, keyed on base), for lookups by address
+    struct vmm_region* right;
+    int32_t height; // of the subtree rooted here, 1 for a leaf
+    uint32_t gap; // unmapped bytes between the previous region's end and base
+    uint32_t max_gap; // largest gap in the subtree rooted here, what free range search prunes on
 } vmm_region_t;
 
-// how many regions we can track at once, using a static pool instead of kmalloc because we might need to create regions before the heap is ready
-// and also because the heap itself needs to be tracked as a region (chicken and egg problem)
-#define VMM_MAX_REGIONS 256
-
 // an address space. wraps a page dir and all the regions mapped to it. right now there's just one (the kernel's) but each process wil get its own later
-// the kernel regions get copies into every new address space so the kernel is always accessible regardless of which process is running
+// the kernel half is the same in every address space, so its regions aren't copied into each one: they're on the kernel space's list
+// alone and every space shares it (vmm_find_region looks kernel-half addresses up there). a process's own list only has user-half regions,
+// so creating and destroying processes never touches kernel region descriptors
 typedef struct {
     uint32_t* page_directory; // physical addr of the page dir
     vmm_region_t* regions; // linked list of memory regions
+    vmm_region_t* region_tree; // the same regions as a balanced tree, vmm_find_region is O(log n)
+    vmm_region_t* last_hit; // what vmm_find_region found last, checked before the tree
     uint32_t region_count; // track
 } vmm_address_space_t;
 
@@ -71,6 +80,12 @@ void vmm_init(void);
 // Will return NULL if we are out of memory
 vmm_address_space_t* vmm_create_address_space(void);
 
+// copy-on-write clone: same regions as parent, with every user page present in parent mapped to the same frame in the clone,
+// read-only on both sides. the first write to such a page on either side faults and that side gets a private copy of just that page,
+// so cloning costs page tables and refcounts, not memory. NULL if we're out of memory, or if parent is the kernel space (its regions
+// only ever live on the shared kernel list, a process can't get copies of them)
+vmm_address_space_t* vmm_clone_address_space(vmm_address_space_t* parent);
+
 // NEVER CALL THIS ON THE KERNEL ADDRESS SPACE
 void vmm_destroy_address_space(vmm_address_space_t* space);
 
@@ -78,11 +93,18 @@ void vmm_destroy_address_space(vmm_address_space_t* space);
 // this is the context switch for memory, when the scheduler picks a new process, it calls this to flip to that process's view of memory
 void vmm_switch_address_space(vmm_address_space_t* space);
 
+// the address space that's loaded in CR3 right now
+vmm_address_space_t* vmm_get_current_space(void);
+
 // grabs pointer to kernel's address space
 vmm_address_space_t* vmm_get_kernel_space(void);
 
 
 // allocates physical frames and maps them into the given address space. the virtual address and size both need to be page-aligned
+// kernel-half ranges only go in the kernel space, every other space shares its regions
+// with VMM_LAZY in flags nothing is allocated yet, the region is only registered (O(1) whatever the size) and pages get backed as they fault in,
+// so a big sparse region (heap, stack) only costs what's actually touched
+// in the kernel half only KHEAP_START and up can be mapped, that's where every directory shares the page tables
 // returns 0 on sucess, -1 on failure
 int vmm_map_region(vmm_address_space_t* space, uint32_t vaddr, uint32_t size, uint32_t flags, vmm_region_type_t type);
 
@@ -90,12 +112,34 @@ int vmm_map_region(vmm_address_space_t* space, uint32_t vaddr, uint32_t size, ui
 int vmm_unmap_region(vmm_address_space_t* space, uint32_t vaddr);
 
 // search for a contiguous chunk of free virtual address space, useful when you need to map something but don't care where it goes
+// first fit: the lowest free range at or above start_hint (0 = VMALLOC_START in the kernel space, the bottom of the user half anywhere else)
+// O(log n) in the number of regions, 0 if nothing fits. a process's space only hands out user-half addresses, the kernel space nothing
+// between the direct map and KHEAP_START
 uint32_t vmm_find_free_region(vmm_address_space_t* space, uint32_t size, uint32_t start_hint);
 
+// top down: the highest free range that ends at or below ceiling (0 = VMALLOC_END in the kernel space, KERNEL_VIRTUAL_BASE, the top of
+// the user half, anywhere else), the way mmap places things below the stack so the bottom of the address space stays free for the heap
+// to grow into. like first fit, the kernel space never gets a kernel-half range below KHEAP_START. 0 if nothing fits
+uint32_t vmm_find_free_region_top_down(vmm_address_space_t* space, uint32_t size, uint32_t ceiling);
+
 vmm_region_t* vmm_find_region(vmm_address_space_t* space, uint32_t vaddr);
 
 int vmm_is_mapped(uint32_t vaddr);
 
+// vmalloc: big kernel buffers that only need to be contiguous virtually. They get their own window between the heap and the kmap slots
+// (the page tables there are preallocated like the rest of the kernel half) and are backed page by page with whatever frames the PMM
+// has, high memory included, so they don't eat into the kheap or need physically contiguous RAM
+// Every buffer is followed by an unmapped guard page, running off the end faults instead of scribbling over the next buffer
+#define VMALLOC_START 0xF9000000 // right after the heap's 16MB (KHEAP_START + KHEAP_MAX_SIZE)
+#define VMALLOC_END 0xFFC00000 // KMAP_BASE
+#define VMALLOC_GUARD_SIZE 0x1000
+
+// size is rounded up to whole pages, the memory comes back zeroed. NULL if the window or the PMM is out of room
+void* vmalloc(size_t size);
+
+// ptr has to be exactly what vmalloc returned
+void vfree(void* ptr);
+
 // dump all regions in an address space to serial console, purely for debugging
 void vmm_dump_regions(vmm_address_space_t* space);
 